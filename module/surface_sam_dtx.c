@@ -39,6 +39,8 @@
 #define SAM_RQST_DTX_CID_LATCH_OPEN			0x09
 #define SAM_RQST_DTX_CID_GET_OPMODE			0x0D
 
+#define SAM_RQST_DTX_TIMEOUT				500	// ms, ioctls only
+
 #define SAM_EVENT_DTX_TC				0x11
 #define SAM_EVENT_DTX_RQID				0x0011
 #define SAM_EVENT_DTX_CID_CONNECTION			0x0c
@@ -79,6 +81,7 @@ struct surface_dtx_dev {
 	bool active;
 	spinlock_t input_lock;
 	struct input_dev *input_dev;
+	struct surface_sam_ssh_event_subscriber event_sub;
 };
 
 struct surface_dtx_client {
@@ -95,7 +98,11 @@ struct surface_dtx_client {
 static struct surface_dtx_dev surface_dtx_dev;
 
 
-static int surface_sam_query_opmpde(void)
+/*
+ * Interactive queries are issued on behalf of userspace: they fail after
+ * SAM_RQST_DTX_TIMEOUT and can be interrupted by signals.
+ */
+static int surface_sam_query_opmpde(bool interactive)
 {
 	u8 result_buf[1];
 	int status;
@@ -107,6 +114,8 @@ static int surface_sam_query_opmpde(void)
 		.snc = 1,
 		.cdl = 0,
 		.pld = NULL,
+		.prio = SURFACE_SAM_SSH_RQST_PRIO_INTERACTIVE,
+		.flags = SURFACE_SAM_SSH_RQST_IDEMPOTENT,
 	};
 
 	struct surface_sam_ssh_buf result = {
@@ -115,6 +124,11 @@ static int surface_sam_query_opmpde(void)
 		.data = result_buf,
 	};
 
+	if (interactive) {
+		rqst.flags  |= SURFACE_SAM_SSH_RQST_INTERRUPTIBLE;
+		rqst.timeout = SAM_RQST_DTX_TIMEOUT;
+	}
+
 	status = surface_sam_ssh_rqst(&rqst, &result);
 	if (status) {
 		return status;
@@ -128,6 +142,13 @@ static int surface_sam_query_opmpde(void)
 }
 
 
+static void dtx_cmd_simple_complete(int status, struct surface_sam_ssh_buf *result, void *data)
+{
+	if (status) {
+		printk(DTX_ERR "EC request failed with error %d\n", status);
+	}
+}
+
 static int dtx_cmd_simple(u8 cid)
 {
 	struct surface_sam_ssh_rqst rqst = {
@@ -137,14 +158,16 @@ static int dtx_cmd_simple(u8 cid)
 		.snc = 0,
 		.cdl = 0,
 		.pld = NULL,
+		.prio = SURFACE_SAM_SSH_RQST_PRIO_INTERACTIVE,
 	};
 
-	return surface_sam_ssh_rqst(&rqst, NULL);
+	// latch commands don't return anything, no need to wait for the EC
+	return surface_sam_ssh_rqst_async(&rqst, NULL, dtx_cmd_simple_complete, NULL);
 }
 
 static int dtx_cmd_get_opmode(int __user *buf)
 {
-	int opmode = surface_sam_query_opmpde();
+	int opmode = surface_sam_query_opmpde(true);
 	if (opmode < 0) {
 		return opmode;
 	}
@@ -388,7 +411,7 @@ static void surface_dtx_update_opmpde(struct surface_dtx_dev *ddev)
 	int opmode;
 
 	// get operation mode
-	opmode = surface_sam_query_opmpde();
+	opmode = surface_sam_query_opmpde(false);
 	if (opmode < 0) {
 		printk(DTX_ERR "EC request failed with error %d\n", opmode);
 	}
@@ -452,7 +475,13 @@ static int surface_dtx_events_setup(struct surface_dtx_dev *ddev)
 {
 	int status;
 
-	status = surface_sam_ssh_set_event_handler(SAM_EVENT_DTX_RQID, surface_dtx_evt_dtx, ddev);
+	ddev->event_sub.rqid     = SAM_EVENT_DTX_RQID;
+	ddev->event_sub.overflow = SURFACE_SAM_SSH_EVENT_OVERFLOW_DROP_OLDEST;
+	ddev->event_sub.flags    = SURFACE_SAM_SSH_EVENT_REPLAY;
+	ddev->event_sub.handler  = surface_dtx_evt_dtx;
+	ddev->event_sub.data     = ddev;
+
+	status = surface_sam_ssh_event_subscribe(&ddev->event_sub);
 	if (status) {
 		goto err_handler;
 	}
@@ -465,15 +494,15 @@ static int surface_dtx_events_setup(struct surface_dtx_dev *ddev)
 	return 0;
 
 err_source:
-	surface_sam_ssh_remove_event_handler(SAM_EVENT_DTX_RQID);
+	surface_sam_ssh_event_unsubscribe(&ddev->event_sub);
 err_handler:
 	return status;
 }
 
-static void surface_dtx_events_disable(void)
+static void surface_dtx_events_disable(struct surface_dtx_dev *ddev)
 {
 	surface_sam_ssh_disable_event_source(SAM_EVENT_DTX_TC, 0x01, SAM_EVENT_DTX_RQID);
-	surface_sam_ssh_remove_event_handler(SAM_EVENT_DTX_RQID);
+	surface_sam_ssh_event_unsubscribe(&ddev->event_sub);
 }
 
 
@@ -495,7 +524,7 @@ static struct input_dev *surface_dtx_register_inputdev(struct platform_device *p
 
 	input_set_capability(input_dev, EV_SW, SW_TABLET_MODE);
 
-	status = surface_sam_query_opmpde();
+	status = surface_sam_query_opmpde(false);
 	if (status < 0) {
 		input_free_device(input_dev);
 		return ERR_PTR(status);
@@ -580,7 +609,7 @@ static int surface_sam_dtx_remove(struct platform_device *pdev)
 	mutex_unlock(&ddev->mutex);
 
 	// After this call we're guaranteed that no more input events will arive
-	surface_dtx_events_disable();
+	surface_dtx_events_disable(ddev);
 
 	// wake up clients
 	spin_lock(&ddev->client_lock);
@@ -22,6 +22,7 @@ static const guid_t SAN_DSM_UUID =
 	          0x48, 0x7c, 0x91, 0xab, 0x3c);
 
 #define SAM_EVENT_DELAY_PWR_STATE	msecs_to_jiffies(5000)
+#define SAM_EVENT_DELAY_TEMP		msecs_to_jiffies(100)
 
 #define SAM_EVENT_PWR_TC		0x02
 #define SAM_EVENT_PWR_RQID		0x0002
@@ -34,6 +35,14 @@ static const guid_t SAN_DSM_UUID =
 #define SAM_EVENT_TEMP_RQID		0x0003
 #define SAM_EVENT_TEMP_CID_NOTIFY_SENSOR_TRIP_POINT	0x0b
 
+#define SAM_RQST_PWR_CID_STA		0x01
+#define SAM_RQST_PWR_CID_BIX		0x02
+#define SAM_RQST_PWR_CID_BST		0x03
+#define SAM_RQST_PWR_CID_PSR		0x0d
+
+#define SAM_RQST_PWR_TTL_STATIC		5000	// ms, STA and BIX
+#define SAM_RQST_PWR_TTL_STATE		1000	// ms, BST and PSR
+
 #define SAN_RQST_TAG            	"surface_sam_san_rqst: "
 
 #define SAN_QUIRK_BASE_STATE_DELAY	1000
@@ -63,6 +72,9 @@ struct san_consumers {
 struct san_drvdata {
 	struct san_opreg_context opreg_ctx;
 	struct san_consumers     consumers;
+	struct surface_sam_ssh_event_subscriber evt_power;
+	struct surface_sam_ssh_event_subscriber evt_thermal;
+	struct surface_sam_ssh_cache_rule cache_power;
 };
 
 struct gsb_data_in {
@@ -268,6 +280,12 @@ inline static int san_evt_thermal_notify(struct device *dev, struct surface_sam_
 	return 0;
 }
 
+static unsigned long san_evt_thermal_delay(struct surface_sam_ssh_event *event, void *data)
+{
+	// collapse bursts of trip-point notifications for the same sensor
+	return SAM_EVENT_DELAY_TEMP;
+}
+
 static int san_evt_thermal(struct surface_sam_ssh_event *event, void *data)
 {
 	struct device *dev = (struct device *)data;
@@ -331,6 +349,33 @@ san_etwl(struct san_opreg_context *ctx, struct gsb_buffer *buffer)
 	return AE_OK;
 }
 
+/*
+ * Battery and adapter status queries have no side effects. They are issued
+ * by ACPI polling and may come in bursts, thus let them share transactions
+ * and cache their responses. Cached responses are dropped on power events,
+ * so the TTL only bounds changes the EC does not notify us about (e.g. the
+ * remaining capacity). Returns zero if the request must not be cached.
+ */
+static u16 san_rqst_ttl(const struct surface_sam_ssh_rqst *rqst)
+{
+	if (rqst->tc != SAM_EVENT_PWR_TC) {
+		return 0;
+	}
+
+	switch (rqst->cid) {
+	case SAM_RQST_PWR_CID_STA:
+	case SAM_RQST_PWR_CID_BIX:
+		return SAM_RQST_PWR_TTL_STATIC;
+
+	case SAM_RQST_PWR_CID_BST:
+	case SAM_RQST_PWR_CID_PSR:
+		return SAM_RQST_PWR_TTL_STATE;
+
+	default:
+		return 0;
+	}
+}
+
 static acpi_status
 san_rqst(struct san_opreg_context *ctx, struct gsb_buffer *buffer)
 {
@@ -351,6 +396,16 @@ san_rqst(struct san_opreg_context *ctx, struct gsb_buffer *buffer)
 	rqst.cdl = gsb_rqst->cdl;
 	rqst.pld = &gsb_rqst->pld[0];
 
+	// battery status is polled by ACPI, don't hold up anything else
+	if (rqst.tc == SAM_EVENT_PWR_TC) {
+		rqst.prio = SURFACE_SAM_SSH_RQST_PRIO_BACKGROUND;
+	}
+
+	rqst.ttl = san_rqst_ttl(&rqst);
+	if (rqst.ttl) {
+		rqst.flags = SURFACE_SAM_SSH_RQST_IDEMPOTENT;
+	}
+
 	result.cap  = SURFACE_SAM_SSH_MAX_RQST_RESPONSE;
 	result.len  = 0;
 	result.data = kzalloc(result.cap, GFP_KERNEL);
@@ -463,52 +518,79 @@ san_opreg_handler(u32 function, acpi_physical_address command,
 	return AE_OK;
 }
 
-static int san_enable_events(struct device *dev)
+static const struct surface_sam_ssh_event_source san_event_sources[] = {
+	{ SAM_EVENT_PWR_TC,  0x01, SAM_EVENT_PWR_RQID  },
+	{ SAM_EVENT_TEMP_TC, 0x01, SAM_EVENT_TEMP_RQID },
+};
+
+static int san_enable_events(struct san_drvdata *d)
 {
+	struct device *dev = d->opreg_ctx.dev;
 	int status;
 
-	status = surface_sam_ssh_set_delayed_event_handler(
-			SAM_EVENT_PWR_RQID, san_evt_power,
-			san_evt_power_delay, dev);
+	d->evt_power.rqid     = SAM_EVENT_PWR_RQID;
+	d->evt_power.flags    = SURFACE_SAM_SSH_EVENT_COALESCE | SURFACE_SAM_SSH_EVENT_REPLAY;
+	d->evt_power.overflow = SURFACE_SAM_SSH_EVENT_OVERFLOW_COALESCE;
+	d->evt_power.handler  = san_evt_power;
+	d->evt_power.delay    = san_evt_power_delay;
+	d->evt_power.data     = dev;
+
+	d->evt_thermal.rqid     = SAM_EVENT_TEMP_RQID;
+	d->evt_thermal.flags    = SURFACE_SAM_SSH_EVENT_COALESCE | SURFACE_SAM_SSH_EVENT_REPLAY;
+	d->evt_thermal.overflow = SURFACE_SAM_SSH_EVENT_OVERFLOW_COALESCE;
+	d->evt_thermal.handler  = san_evt_thermal;
+	d->evt_thermal.delay    = san_evt_thermal_delay;
+	d->evt_thermal.data     = dev;
+
+	d->cache_power.event_tc = SAM_EVENT_PWR_TC;
+	d->cache_power.rqst_tc  = SAM_EVENT_PWR_TC;
+
+	status = surface_sam_ssh_cache_rule_add(&d->cache_power);
 	if (status) {
-		goto err_handler_power;
+		goto err_cache_rule;
 	}
 
-	status = surface_sam_ssh_set_event_handler(
-			SAM_EVENT_TEMP_RQID, san_evt_thermal,
-			dev);
+	status = surface_sam_ssh_event_subscribe(&d->evt_power);
 	if (status) {
-		goto err_handler_thermal;
+		goto err_handler_power;
 	}
 
-	status = surface_sam_ssh_enable_event_source(SAM_EVENT_PWR_TC, 0x01, SAM_EVENT_PWR_RQID);
+	status = surface_sam_ssh_event_subscribe(&d->evt_thermal);
 	if (status) {
-		goto err_source_power;
+		goto err_handler_thermal;
 	}
 
-	status = surface_sam_ssh_enable_event_source(SAM_EVENT_TEMP_TC, 0x01, SAM_EVENT_TEMP_RQID);
+	status = surface_sam_ssh_enable_event_sources(san_event_sources,
+						      ARRAY_SIZE(san_event_sources));
 	if (status) {
-		goto err_source_thermal;
+		goto err_source;
 	}
 
 	return 0;
 
-err_source_thermal:
-	surface_sam_ssh_disable_event_source(SAM_EVENT_PWR_TC, 0x01, SAM_EVENT_PWR_RQID);
-err_source_power:
-	surface_sam_ssh_remove_event_handler(SAM_EVENT_TEMP_RQID);
+err_source:
+	/*
+	 * The sources are enabled as one batch, we don't know which of them
+	 * succeeded. Disable all of them.
+	 */
+	surface_sam_ssh_disable_event_sources(san_event_sources,
+					      ARRAY_SIZE(san_event_sources));
+	surface_sam_ssh_event_unsubscribe(&d->evt_thermal);
 err_handler_thermal:
-	surface_sam_ssh_remove_event_handler(SAM_EVENT_PWR_RQID);
+	surface_sam_ssh_event_unsubscribe(&d->evt_power);
 err_handler_power:
+	surface_sam_ssh_cache_rule_remove(&d->cache_power);
+err_cache_rule:
 	return status;
 }
 
-static void san_disable_events(void)
+static void san_disable_events(struct san_drvdata *d)
 {
-	surface_sam_ssh_disable_event_source(SAM_EVENT_TEMP_TC, 0x01, SAM_EVENT_TEMP_RQID);
-	surface_sam_ssh_disable_event_source(SAM_EVENT_PWR_TC, 0x01, SAM_EVENT_PWR_RQID);
-	surface_sam_ssh_remove_event_handler(SAM_EVENT_TEMP_RQID);
-	surface_sam_ssh_remove_event_handler(SAM_EVENT_PWR_RQID);
+	surface_sam_ssh_disable_event_sources(san_event_sources,
+					      ARRAY_SIZE(san_event_sources));
+	surface_sam_ssh_event_unsubscribe(&d->evt_thermal);
+	surface_sam_ssh_event_unsubscribe(&d->evt_power);
+	surface_sam_ssh_cache_rule_remove(&d->cache_power);
 }
 
 
@@ -644,7 +726,7 @@ static int surface_sam_san_probe(struct platform_device *pdev)
 		goto err_install_handler;
 	}
 
-	status = san_enable_events(&pdev->dev);
+	status = san_enable_events(drvdata);
 	if (status) {
 		goto err_enable_events;
 	}
@@ -669,7 +751,7 @@ static int surface_sam_san_remove(struct platform_device *pdev)
 	acpi_status status = AE_OK;
 
 	acpi_remove_address_space_handler(san, ACPI_ADR_SPACE_GSBUS, &san_opreg_handler);
-	san_disable_events();
+	san_disable_events(drvdata);
 
 	san_consumers_unlink(&drvdata->consumers);
 	kfree(drvdata);
@@ -152,6 +152,13 @@ static const struct dmi_system_id dmi_lid_device_table[] = {
 
 #define SID_PARAM_PERM		(S_IRUGO | S_IWUSR)
 
+/*
+ * The performance mode is only changed by us, and setting it drops the
+ * cached value. The TTL bounds changes by firmware.
+ */
+#define SAM_PERF_MODE_TTL	1000	// ms
+#define SAM_PERF_MODE_TIMEOUT	500	// ms, queried on behalf of userspace
+
 enum sam_perf_mode {
 	SAM_PERF_MODE_NORMAL   = 1,
 	SAM_PERF_MODE_BATTERY  = 2,
@@ -186,6 +193,11 @@ static int surface_sam_perf_mode_get(void)
 		.snc = 0x01,
 		.cdl = 0x00,
 		.pld = NULL,
+		.prio = SURFACE_SAM_SSH_RQST_PRIO_INTERACTIVE,
+		.flags = SURFACE_SAM_SSH_RQST_IDEMPOTENT
+		       | SURFACE_SAM_SSH_RQST_INTERRUPTIBLE,
+		.ttl = SAM_PERF_MODE_TTL,
+		.timeout = SAM_PERF_MODE_TIMEOUT,
 	};
 
 	struct surface_sam_ssh_buf result = {
@@ -206,6 +218,13 @@ static int surface_sam_perf_mode_get(void)
 	return get_unaligned_le32(&result.data[0]);
 }
 
+static void surface_sam_perf_mode_set_complete(int status, struct surface_sam_ssh_buf *result, void *data)
+{
+	if (status) {
+		printk(KERN_ERR "surface_sam_sid: failed to set performance mode: %d\n", status);
+	}
+}
+
 static int surface_sam_perf_mode_set(int perf_mode)
 {
 	u8 payload[4] = { 0 };
@@ -217,6 +236,7 @@ static int surface_sam_perf_mode_set(int perf_mode)
 		.snc = 0x00,
 		.cdl = ARRAY_SIZE(payload),
 		.pld = payload,
+		.prio = SURFACE_SAM_SSH_RQST_PRIO_INTERACTIVE,
 	};
 
 	if (perf_mode < __SAM_PERF_MODE__START || perf_mode > __SAM_PERF_MODE__END) {
@@ -224,7 +244,9 @@ static int surface_sam_perf_mode_set(int perf_mode)
 	}
 
 	put_unaligned_le32(perf_mode, &rqst.pld[0]);
-	return surface_sam_ssh_rqst(&rqst, NULL);
+
+	// no response expected, don't wait for the EC to acknowledge
+	return surface_sam_ssh_rqst_async(&rqst, NULL, surface_sam_perf_mode_set_complete, NULL);
 }
 
 
@@ -265,7 +287,9 @@ static ssize_t perf_mode_show(struct device *dev, struct device_attribute *attr,
 	int perf_mode;
 
 	perf_mode = surface_sam_perf_mode_get();
-	if (perf_mode < 0) {
+	if (perf_mode == -ERESTARTSYS) {
+		return perf_mode;
+	} else if (perf_mode < 0) {
 		dev_err(dev, "failed to get current performance mode: %d", perf_mode);
 		return -EIO;
 	}
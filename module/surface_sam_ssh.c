@@ -7,15 +7,25 @@
 #include <linux/acpi.h>
 #include <linux/completion.h>
 #include <linux/crc-ccitt.h>
+#include <linux/debugfs.h>
 #include <linux/dmaengine.h>
 #include <linux/jiffies.h>
 #include <linux/kernel.h>
 #include <linux/kfifo.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
 #include <linux/mutex.h>
 #include <linux/pm.h>
+#include <linux/random.h>
+#include <linux/rculist.h>
 #include <linux/refcount.h>
+#include <linux/rwsem.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/serdev.h>
+#include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/wait.h>
 #include <linux/workqueue.h>
 
 #include "surface_sam_ssh.h"
@@ -59,11 +69,34 @@
 
 #define SSH_WRITE_TIMEOUT		msecs_to_jiffies(1000)
 #define SSH_READ_TIMEOUT		msecs_to_jiffies(1000)
-#define SSH_NUM_RETRY			3
-
-#define SSH_WRITE_BUF_LEN		SSH_MAX_WRITE
-#define SSH_READ_BUF_LEN		512		// must be power of 2
-#define SSH_EVAL_BUF_LEN		SSH_MAX_WRITE	// also works for reading
+#define SSH_NUM_RETRY			3		// min. number of transmissions
+#define SSH_ACK_BUDGET			(SSH_NUM_RETRY * SSH_READ_TIMEOUT)
+
+#define SSH_RTO_MIN_US			(30 * USEC_PER_MSEC)
+#define SSH_RTO_MAX_US			(1000 * USEC_PER_MSEC)
+#define SSH_RTO_GRANULARITY_US		(4 * USEC_PER_MSEC)
+#define SSH_RTO_MAX_BACKOFF		5		// MIN << MAX_BACKOFF ~ MAX
+#define SSH_NUM_TC			256
+
+#define SSH_WRITE_BUF_LEN (				\
+	  SSH_MAX_WRITE * SSH_PENDING_MAX		\
+	+ SSH_MSG_LEN_CTRL * SSH_ACK_QUEUE_LEN		\
+)	// one burst of commands and ACKs
+#define SSH_FRAME_BUF_LEN		(SSH_MSG_LEN_CMD_BASE + 0xff)	// largest message
+
+#define SSH_PENDING_MAX			4		// must be power of 2
+#define SSH_RQST_AGING_MS		250		// max. wait before class is ignored
+#define SSH_CACHE_SIZE			16
+#define SSH_CACHE_KEY_PLD		8		// max. payload of cached requests
+#define SSH_RCV_RECENT_LEN		16
+#define SSH_ACK_QUEUE_LEN		32		// must be power of 2
+#define SSH_EVENT_POOL_SIZE		64
+#define SSH_EVENT_RT_QUEUE_LEN		16		// must be power of 2
+#define SSH_EVENT_RT_PRIO_DEFAULT	(MAX_RT_PRIO / 2)
+#define SSH_EVENT_BACKLOG_DEFAULT	16
+#define SSH_EVENT_EARLY_LEN		4		// per RQID
+#define SSH_EVENT_EARLY_MAX		16		// over all RQIDs
+#define SSH_EVENT_EARLY_AGE_MS		5000		// max. age for replay
 
 #define SSH_FRAME_TYPE_CMD		0x80
 #define SSH_FRAME_TYPE_ACK		0x40
@@ -128,75 +161,290 @@ struct ssh_counters {
 	u16 rqid;		// id for request/response matching
 };
 
+/*
+ * ACKs are queued by the receiver (single producer) and sent by the
+ * transmitter (single consumer) together with the next command burst.
+ *
+ * The transmitter owns the UART. It hands the buffer to the serial core
+ * without blocking and continues from write_wakeup once there is room
+ * again, or from the timeout work if the write stalls. Both run on the
+ * single-threaded TX queue and are the sole users of everything but the
+ * ACK queue.
+ */
 struct ssh_writer {
 	u8 *data;
-	u8 *ptr;
-} __packed;
+	u8 *ptr;			// end of data, equals data if idle
+	u8 *head;			// next byte to hand to the UART
+	unsigned long deadline;
+	struct ssh_request *burst[SSH_PENDING_MAX];	// commands in data
+	int n_burst;
+	int n_ack;
+	struct work_struct work;
+	struct delayed_work timeout;
+	DECLARE_KFIFO(ack, u8, SSH_ACK_QUEUE_LEN);
+};
+
+enum ssh_request_state {
+	SSH_RQST_QUEUED,
+	SSH_RQST_SHARED,	// follower of an identical request
+	SSH_RQST_PENDING_ACK,
+	SSH_RQST_PENDING_RSP,
+	SSH_RQST_COMPLETED,
+};
+
+/*
+ * A submitted request. Requests wait in the queue until the transmitter
+ * assigns them an RQID and sequence ID, after which they are stored in the
+ * pending table (indexed by RQID) until completed. Idempotent requests
+ * identical to a queued or pending one are instead added to the followers of
+ * that request and completed along with it. State, timing, and list fields
+ * are protected by the pending-table lock.
+ */
+struct ssh_request {
+	struct list_head node;
+	refcount_t refcount;
+	struct sam_ssh_ec *ec;
+
+	enum ssh_request_state state;
+	bool expect_rsp;
+	bool resend;		// ACK timed out or RETRY received
+	u8 tries;
+	unsigned long first_sent;	// jiffies, for the ACK budget
+	u16 rqid;
+	u8 seq;
+	unsigned long expires;
+	unsigned long deadline;	// only valid if rqst.timeout is set
+	ktime_t queued;		// time of submission, for class wait time
+	u32 cache_gen;		// cache generation of the TC on submission, idempotent only
+	ktime_t sent;		// start of last transmission, for RTT measurement
+	ktime_t acked;
+
+	struct surface_sam_ssh_buf *result;
+	surface_sam_ssh_rqst_complete_fn complete;
+	void *complete_data;
+	struct list_head followers;
+
+	struct surface_sam_ssh_rqst rqst;
+	u8 pld[];
+};
 
-enum ssh_receiver_state {
-	SSH_RCV_DISCARD,
-	SSH_RCV_CONTROL,
-	SSH_RCV_COMMAND,
+/*
+ * Statistics of a request priority class, protected by the pending-table
+ * lock. Wait time is measured from submission to first transmission.
+ */
+struct ssh_rqst_class {
+	unsigned int depth;
+	unsigned int depth_max;
+	u64 dispatched;
+	u64 aged;		// sent ahead of a higher class due to aging
+	u64 wait_ns;
+	u64 wait_max_ns;
+};
+
+struct ssh_pending {
+	spinlock_t lock;
+	wait_queue_head_t waitq;
+	struct workqueue_struct *queue_tx;
+	struct list_head queue[SURFACE_SAM_SSH_RQST_PRIO_NUM];
+	struct ssh_rqst_class class[SURFACE_SAM_SSH_RQST_PRIO_NUM];
+	struct ssh_request *slot[SSH_PENDING_MAX];
+	u64 shared;		// requests completed as followers
+	struct delayed_work reaper;
+	unsigned long reaper_expires;
+	bool reaper_armed;
+};
+
+enum ssh_rcv_stage {
+	SSH_RCV_SYNC,		// nothing validated yet
+	SSH_RCV_HDR,		// SYN validated, frame type known
+	SSH_RCV_BODY,		// control frame CRC validated (command messages)
+};
+
+struct ssh_rcv_state {
+	enum ssh_rcv_stage stage;
+	u16 crc;		// running CRC of the command frame
+	u16 crc_offs;		// message offset up to which the CRC has been computed
+};
+
+/*
+ * Round-trip time estimate (Jacobson/Karels), in microseconds.
+ */
+struct ssh_rtt {
+	u32 srtt;
+	u32 rttvar;
+	u32 samples;
+};
+
+/*
+ * Round-trip times, protected by the pending-table lock. The ACK round-trip
+ * is a property of the link and determines the re-transmission timeout. The
+ * response time depends on the target controller (and command) and is only
+ * tracked for diagnostics: a response timeout is not retried, so it stays at
+ * SSH_READ_TIMEOUT to not fail slow requests (e.g. battery information).
+ */
+struct ssh_rtt_stats {
+	struct ssh_rtt ack;
+	struct ssh_rtt rsp[SSH_NUM_TC];
+	unsigned int backoff;
 };
 
 struct ssh_receiver {
 	spinlock_t lock;
-	enum ssh_receiver_state state;
-	struct completion signal;
-	struct kfifo fifo;
-	struct {
-		bool pld;
-		u8 seq;
-		u16 rqid;
-	} expect;
 	struct {
 		u16 cap;
 		u16 len;
 		u8 *ptr;
-	} eval_buf;
+		struct ssh_rcv_state state;
+	} frame;		// partial message spanning multiple receive calls
+	struct {
+		u8  seq[SSH_RCV_RECENT_LEN];
+		u16 rqid[SSH_RCV_RECENT_LEN];
+		unsigned int head;
+		unsigned int len;
+	} recent;		// recently received command messages
+	u64 skipped;		// bytes discarded while looking for SYN
+	u64 duplicates;		// re-transmitted command messages dropped
+	ktime_t timestamp;	// arrival of the data currently being parsed
 };
 
-struct ssh_event_handler {
-	surface_sam_ssh_event_handler_fn handler;
-	surface_sam_ssh_event_handler_delay delay;
-	void *data;
+struct ssh_event_work {
+	struct list_head node;		// pool free-list or source queue
+	struct sam_ssh_ec *ec;
+	struct surface_sam_ssh_event_subscriber *sub;
+	struct delayed_work work_evt;	// delay before entering the source queue
+	struct surface_sam_ssh_event event;
+	u8 pld[SURFACE_SAM_SSH_MAX_RQST_RESPONSE];
+};
+
+/*
+ * Event work items are preallocated on probe, so that receiving an event
+ * never has to allocate memory in atomic context.
+ */
+struct ssh_event_pool {
+	spinlock_t lock;
+	struct list_head free;
+	struct ssh_event_work *items;
+	unsigned int used;
+	unsigned int high;		// high-water mark of used
+	u64 exhausted;			// events dropped due to an empty pool
+};
+
+/*
+ * Dispatch lane for immediate events (e.g. keyboard input), so that their
+ * handlers neither run under the receiver lock nor wait behind other events
+ * on the workqueue. The receiver and the replay of buffered events on
+ * subscribe push to the queue, serialized by the lock, which also protects
+ * the queued and overflow counters. The thread (single consumer) runs the
+ * handlers. The queued/done counters allow waiting until everything queued up
+ * to a given point has been handled.
+ */
+struct ssh_event_rt {
+	spinlock_t lock;		// producers
+	struct task_struct *thread;
+	wait_queue_head_t waitq;	// thread waits for work
+	wait_queue_head_t idle;		// flush waits for done
+	DECLARE_KFIFO(queue, struct ssh_event_work *, SSH_EVENT_RT_QUEUE_LEN);
+	unsigned long queued;
+	unsigned long done;
+	u64 overflow;			// events dropped due to a full queue
 };
 
+/*
+ * Events of one source (RQID) are handled in order of arrival by the work
+ * item of that source. As a work item never runs concurrently with itself,
+ * different sources run in parallel without being able to block each other.
+ */
+struct ssh_event_source {
+	spinlock_t lock;
+	struct list_head queue;
+	struct list_head delayed;	// events waiting for their delay to expire
+	struct work_struct work;
+	unsigned int backlog;		// delayed and queued events, not yet started
+	unsigned int depth;		// queued and running events
+	unsigned int depth_max;
+	u64 handled;
+	u64 runtime_ns;			// total handler runtime
+	u64 runtime_max_ns;
+	u64 latency_ns;			// total receipt-to-handler-start time
+	u64 latency_max_ns;
+	u64 coalesced;			// events merged into a waiting event
+	u64 dropped;			// events dropped due to backlog limit
+};
+
+/*
+ * Subscribers are kept in one list per event RQID. The lists are traversed
+ * under RCU by the receiver, the lock only serializes (un-)subscribing. The
+ * wait queue is woken whenever a subscriber's last pending event is released.
+ *
+ * Events without subscriber are kept (up to a limit) in the per-RQID early
+ * lists, protected by the lock, and replayed to the first subscriber that
+ * matches them and asks for replay. This catches events sent while consumers are still probing.
+ * Buffered events are dropped once they are older than the age limit, so
+ * they neither hold pool items for good nor get replayed arbitrarily late.
+ */
 struct ssh_events {
 	spinlock_t lock;
-	struct workqueue_struct *queue_ack;
+	wait_queue_head_t waitq;
 	struct workqueue_struct *queue_evt;
-	struct ssh_event_handler handler[SAM_NUM_EVENT_TYPES];
+	struct list_head subscribers[SAM_NUM_EVENT_TYPES];
+	struct list_head early[SAM_NUM_EVENT_TYPES];
+	unsigned int early_len[SAM_NUM_EVENT_TYPES];
+	unsigned int early_total;
+	struct delayed_work early_expire;
+	struct ssh_event_source source[SAM_NUM_EVENT_TYPES];
+	struct ssh_event_pool pool;
+	struct ssh_event_rt rt;
+};
+
+/*
+ * Cached response of an idempotent request, keyed by target category,
+ * instance ID, command ID, and payload.
+ */
+struct ssh_cache_entry {
+	bool valid;
+	unsigned long expires;
+	u8 tc;
+	u8 iid;
+	u8 cid;
+	u8 cdl;
+	u8 pld[SSH_CACHE_KEY_PLD];
+	u8 len;
+	u8 data[SURFACE_SAM_SSH_MAX_RQST_RESPONSE];
+};
+
+/*
+ * Response cache. The generation of a target category is incremented each
+ * time its entries are invalidated. A response is only stored if the
+ * generation did not change since its request has been submitted, as it may
+ * be outdated otherwise.
+ */
+struct ssh_cache {
+	spinlock_t lock;
+	struct ssh_cache_entry entry[SSH_CACHE_SIZE];
+	struct list_head rules;
+	u32 generation[SSH_NUM_TC];
+	u64 hits[SSH_NUM_TC];
+	u64 misses[SSH_NUM_TC];
+	u64 invalidated[SSH_NUM_TC];
 };
 
 struct sam_ssh_ec {
-	struct mutex lock;
+	struct rw_semaphore lock;
 	enum ssh_ec_state state;
 	struct serdev_device *serdev;
 	struct ssh_counters counter;
 	struct ssh_writer writer;
+	struct ssh_pending pending;
+	struct ssh_rtt_stats rtt;
 	struct ssh_receiver receiver;
 	struct ssh_events events;
-};
-
-struct ssh_fifo_packet {
-	u8 type;	// packet type (ACK/RETRY/CMD)
-	u8 seq;
-	u8 len;
-};
-
-struct ssh_event_work {
-	refcount_t refcount;
-	struct sam_ssh_ec *ec;
-	struct work_struct work_ack;
-	struct delayed_work work_evt;
-	struct surface_sam_ssh_event event;
-	u8 seq;
+	struct ssh_cache cache;
+	struct dentry *debugfs;
 };
 
 
 static struct sam_ssh_ec ssh_ec = {
-	.lock   = __MUTEX_INITIALIZER(ssh_ec.lock),
+	.lock   = __RWSEM_INITIALIZER(ssh_ec.lock),
 	.state  = SSH_EC_UNINITIALIZED,
 	.serdev = NULL,
 	.counter = {
@@ -207,34 +455,67 @@ static struct sam_ssh_ec ssh_ec = {
 		.data = NULL,
 		.ptr  = NULL,
 	},
+	.pending = {
+		.lock  = __SPIN_LOCK_UNLOCKED(),
+		.waitq = __WAIT_QUEUE_HEAD_INITIALIZER(ssh_ec.pending.waitq),
+		.queue = {
+			LIST_HEAD_INIT(ssh_ec.pending.queue[0]),
+			LIST_HEAD_INIT(ssh_ec.pending.queue[1]),
+			LIST_HEAD_INIT(ssh_ec.pending.queue[2]),
+		},
+		.slot  = {},
+	},
 	.receiver = {
 		.lock = __SPIN_LOCK_UNLOCKED(),
-		.state = SSH_RCV_DISCARD,
-		.expect = {},
 	},
 	.events = {
 		.lock = __SPIN_LOCK_UNLOCKED(),
-		.handler = {},
-	}
+		.waitq = __WAIT_QUEUE_HEAD_INITIALIZER(ssh_ec.events.waitq),
+		.subscribers = {},
+		.early = {},
+		.pool = {
+			.lock = __SPIN_LOCK_UNLOCKED(),
+			.free = LIST_HEAD_INIT(ssh_ec.events.pool.free),
+		},
+		.rt = {
+			.waitq = __WAIT_QUEUE_HEAD_INITIALIZER(ssh_ec.events.rt.waitq),
+			.idle  = __WAIT_QUEUE_HEAD_INITIALIZER(ssh_ec.events.rt.idle),
+		},
+	},
+	.cache = {
+		.lock  = __SPIN_LOCK_UNLOCKED(),
+		.rules = LIST_HEAD_INIT(ssh_ec.cache.rules),
+	},
 };
 
 
-static int surface_sam_ssh_rqst_unlocked(struct sam_ssh_ec *ec,
-					 const struct surface_sam_ssh_rqst *rqst,
-					 struct surface_sam_ssh_buf *result);
+static int surface_sam_ssh_rqst_batch_unlocked(struct sam_ssh_ec *ec,
+					       const struct surface_sam_ssh_rqst *rqsts,
+					       struct surface_sam_ssh_buf *results,
+					       int count);
+static void ssh_event_cancel(struct sam_ssh_ec *ec,
+			     struct surface_sam_ssh_event_subscriber *sub);
+static void ssh_event_replay_early(struct sam_ssh_ec *ec,
+				   struct surface_sam_ssh_event_subscriber *sub);
 
 
+/*
+ * The EC lock guards the EC state. It is held exclusively for state changes
+ * (probe, remove, suspend, resume) and shared for everything else, i.e.
+ * multiple requests may be in flight at the same time.
+ */
+
 inline static struct sam_ssh_ec *surface_sam_ssh_acquire(void)
 {
 	struct sam_ssh_ec *ec = &ssh_ec;
 
-	mutex_lock(&ec->lock);
+	down_write(&ec->lock);
 	return ec;
 }
 
 inline static void surface_sam_ssh_release(struct sam_ssh_ec *ec)
 {
-	mutex_unlock(&ec->lock);
+	up_write(&ec->lock);
 }
 
 inline static struct sam_ssh_ec *surface_sam_ssh_acquire_init(void)
@@ -249,23 +530,49 @@ inline static struct sam_ssh_ec *surface_sam_ssh_acquire_init(void)
 	return ec;
 }
 
+inline static struct sam_ssh_ec *surface_sam_ssh_acquire_shared(void)
+{
+	struct sam_ssh_ec *ec = &ssh_ec;
+
+	down_read(&ec->lock);
+	return ec;
+}
+
+inline static void surface_sam_ssh_release_shared(struct sam_ssh_ec *ec)
+{
+	up_read(&ec->lock);
+}
+
+inline static struct sam_ssh_ec *surface_sam_ssh_acquire_shared_init(void)
+{
+	struct sam_ssh_ec *ec = surface_sam_ssh_acquire_shared();
+
+	if (ec->state == SSH_EC_UNINITIALIZED) {
+		surface_sam_ssh_release_shared(ec);
+		return NULL;
+	}
+
+	return ec;
+}
+
 int surface_sam_ssh_consumer_register(struct device *consumer)
 {
 	u32 flags = DL_FLAG_PM_RUNTIME | DL_FLAG_AUTOREMOVE_CONSUMER;
 	struct sam_ssh_ec *ec;
 	struct device_link *link;
 
-	ec = surface_sam_ssh_acquire_init();
+	ec = surface_sam_ssh_acquire_shared_init();
 	if (!ec) {
 		return -ENXIO;
 	}
 
 	link = device_link_add(consumer, &ec->serdev->dev, flags);
 	if (!link) {
+		surface_sam_ssh_release_shared(ec);
 		return -EFAULT;
 	}
 
-	surface_sam_ssh_release(ec);
+	surface_sam_ssh_release_shared(ec);
 	return 0;
 }
 EXPORT_SYMBOL_GPL(surface_sam_ssh_consumer_register);
@@ -280,186 +587,276 @@ inline static bool sam_rqid_is_event(u16 rqid) {
 	return rqid != 0 && (rqid | mask) == mask;
 }
 
-int surface_sam_ssh_enable_event_source(u8 tc, u8 unknown, u16 rqid)
+#define SSH_EVENT_SOURCE_PLD_LEN	4
+
+static int ssh_event_sources_ctl(u8 cid, const char *what,
+				 const struct surface_sam_ssh_event_source *src,
+				 int count)
 {
+	struct surface_sam_ssh_rqst *rqsts;
+	struct surface_sam_ssh_buf *results;
 	struct sam_ssh_ec *ec;
+	u8 *data, *pld, *buf;
+	int status;
+	int i;
 
-	u8 pld[4] = { tc, unknown, rqid & 0xff, rqid >> 8 };
-	u8 buf[1] = { 0x00 };
-
-	struct surface_sam_ssh_rqst rqst = {
-		.tc  = 0x01,
-		.iid = 0x00,
-		.cid = 0x0b,
-		.snc = 0x01,
-		.cdl = 0x04,
-		.pld = pld,
-	};
+	if (count <= 0) {
+		return -EINVAL;
+	}
 
-	struct surface_sam_ssh_buf result = {
-		result.cap = ARRAY_SIZE(buf),
-		result.len = 0,
-		result.data = buf,
-	};
+	// only allow RQIDs that lie within event spectrum
+	for (i = 0; i < count; i++) {
+		if (!sam_rqid_is_event(src[i].rqid)) {
+			return -EINVAL;
+		}
+	}
 
-	int status;
+	// one block for requests, results, payloads, and result buffers
+	data = kcalloc(count, sizeof(*rqsts) + sizeof(*results)
+			      + SSH_EVENT_SOURCE_PLD_LEN + 1, GFP_KERNEL);
+	if (!data) {
+		return -ENOMEM;
+	}
 
-	// only allow RQIDs that lie within event spectrum
-	if (!sam_rqid_is_event(rqid)) {
-		return -EINVAL;
+	rqsts   = (struct surface_sam_ssh_rqst *)data;
+	results = (struct surface_sam_ssh_buf *)(rqsts + count);
+	pld     = (u8 *)(results + count);
+	buf     = pld + count * SSH_EVENT_SOURCE_PLD_LEN;
+
+	for (i = 0; i < count; i++) {
+		u8 *p = pld + i * SSH_EVENT_SOURCE_PLD_LEN;
+
+		p[0] = src[i].tc;
+		p[1] = src[i].unknown;
+		p[2] = src[i].rqid & 0xff;
+		p[3] = src[i].rqid >> 8;
+
+		rqsts[i].tc  = 0x01;
+		rqsts[i].iid = 0x00;
+		rqsts[i].cid = cid;
+		rqsts[i].snc = 0x01;
+		rqsts[i].cdl = SSH_EVENT_SOURCE_PLD_LEN;
+		rqsts[i].pld = p;
+
+		results[i].cap  = 1;
+		results[i].len  = 0;
+		results[i].data = &buf[i];
 	}
 
-	ec = surface_sam_ssh_acquire_init();
+	ec = surface_sam_ssh_acquire_shared_init();
 	if (!ec) {
 		printk(KERN_WARNING SSH_RQST_TAG_FULL "embedded controller is uninitialized\n");
-		return -ENXIO;
+		status = -ENXIO;
+		goto out;
 	}
 
 	if (ec->state == SSH_EC_SUSPENDED) {
 		dev_warn(&ec->serdev->dev, SSH_RQST_TAG "embedded controller is suspended\n");
 
-		surface_sam_ssh_release(ec);
-		return -EPERM;
+		surface_sam_ssh_release_shared(ec);
+		status = -EPERM;
+		goto out;
 	}
 
-	status = surface_sam_ssh_rqst_unlocked(ec, &rqst, &result);
+	status = surface_sam_ssh_rqst_batch_unlocked(ec, rqsts, results, count);
 
-	if (buf[0] != 0x00) {
-		dev_warn(&ec->serdev->dev,
-		         "unexpected result while enabling event source: 0x%02x\n",
-			 buf[0]);
+	for (i = 0; i < count; i++) {
+		if (buf[i] != 0x00) {
+			dev_warn(&ec->serdev->dev,
+			         "unexpected result while %s event source: 0x%02x\n",
+				 what, buf[i]);
+		}
 	}
 
-	surface_sam_ssh_release(ec);
+	surface_sam_ssh_release_shared(ec);
+out:
+	kfree(data);
 	return status;
+}
 
+int surface_sam_ssh_enable_event_sources(const struct surface_sam_ssh_event_source *src, int count)
+{
+	return ssh_event_sources_ctl(0x0b, "enabling", src, count);
 }
-EXPORT_SYMBOL_GPL(surface_sam_ssh_enable_event_source);
+EXPORT_SYMBOL_GPL(surface_sam_ssh_enable_event_sources);
 
-int surface_sam_ssh_disable_event_source(u8 tc, u8 unknown, u16 rqid)
+int surface_sam_ssh_disable_event_sources(const struct surface_sam_ssh_event_source *src, int count)
 {
-	struct sam_ssh_ec *ec;
+	return ssh_event_sources_ctl(0x0c, "disabling", src, count);
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_disable_event_sources);
 
-	u8 pld[4] = { tc, unknown, rqid & 0xff, rqid >> 8 };
-	u8 buf[1] = { 0x00 };
+int surface_sam_ssh_enable_event_source(u8 tc, u8 unknown, u16 rqid)
+{
+	struct surface_sam_ssh_event_source src = { tc, unknown, rqid };
 
-	struct surface_sam_ssh_rqst rqst = {
-		.tc  = 0x01,
-		.iid = 0x00,
-		.cid = 0x0c,
-		.snc = 0x01,
-		.cdl = 0x04,
-		.pld = pld,
-	};
+	return surface_sam_ssh_enable_event_sources(&src, 1);
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_enable_event_source);
 
-	struct surface_sam_ssh_buf result = {
-		result.cap = ARRAY_SIZE(buf),
-		result.len = 0,
-		result.data = buf,
-	};
+int surface_sam_ssh_disable_event_source(u8 tc, u8 unknown, u16 rqid)
+{
+	struct surface_sam_ssh_event_source src = { tc, unknown, rqid };
 
-	int status;
+	return surface_sam_ssh_disable_event_sources(&src, 1);
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_disable_event_source);
 
-	// only allow RQIDs that lie within event spectrum
-	if (!sam_rqid_is_event(rqid)) {
+int surface_sam_ssh_event_subscribe(struct surface_sam_ssh_event_subscriber *sub)
+{
+	struct sam_ssh_ec *ec;
+	unsigned long flags;
+
+	if (!sam_rqid_is_event(sub->rqid) || !sub->handler) {
 		return -EINVAL;
 	}
 
-	ec = surface_sam_ssh_acquire_init();
+	ec = surface_sam_ssh_acquire_shared_init();
 	if (!ec) {
-		printk(KERN_WARNING SSH_RQST_TAG_FULL "embedded controller is uninitialized\n");
 		return -ENXIO;
 	}
 
-	if (ec->state == SSH_EC_SUSPENDED) {
-		dev_warn(&ec->serdev->dev, SSH_RQST_TAG "embedded controller is suspended\n");
+	atomic_set(&sub->pending, 0);
+	sub->removed = false;
 
-		surface_sam_ssh_release(ec);
-		return -EPERM;
+	spin_lock_irqsave(&ec->events.lock, flags);
+
+	/*
+	 * Replay before adding the subscriber: new events arriving in between
+	 * don't see it yet and wait for the lock (see ssh_handle_event), so
+	 * they are delivered after the buffered ones.
+	 */
+	if (sub->flags & SURFACE_SAM_SSH_EVENT_REPLAY) {
+		ssh_event_replay_early(ec, sub);
 	}
 
-	status = surface_sam_ssh_rqst_unlocked(ec, &rqst, &result);
+	// 0 is not a valid event RQID
+	list_add_tail_rcu(&sub->node, &ec->events.subscribers[sub->rqid - 1]);
 
-	if (buf[0] != 0x00) {
-		dev_warn(&ec->serdev->dev,
-		         "unexpected result while disabling event source: 0x%02x\n",
-			 buf[0]);
-	}
+	spin_unlock_irqrestore(&ec->events.lock, flags);
+	surface_sam_ssh_release_shared(ec);
 
-	surface_sam_ssh_release(ec);
-	return status;
+	return 0;
 }
-EXPORT_SYMBOL_GPL(surface_sam_ssh_disable_event_source);
+EXPORT_SYMBOL_GPL(surface_sam_ssh_event_subscribe);
 
-int surface_sam_ssh_set_delayed_event_handler(
-		u16 rqid, surface_sam_ssh_event_handler_fn fn,
-		surface_sam_ssh_event_handler_delay delay,
-		void *data)
+int surface_sam_ssh_event_unsubscribe(struct surface_sam_ssh_event_subscriber *sub)
 {
 	struct sam_ssh_ec *ec;
 	unsigned long flags;
 
-	if (!sam_rqid_is_event(rqid)) {
-		return -EINVAL;
-	}
-
-	ec = surface_sam_ssh_acquire_init();
+	ec = surface_sam_ssh_acquire_shared_init();
 	if (!ec) {
 		return -ENXIO;
 	}
 
 	spin_lock_irqsave(&ec->events.lock, flags);
+	list_del_rcu(&sub->node);
+	WRITE_ONCE(sub->removed, true);
+	spin_unlock_irqrestore(&ec->events.lock, flags);
 
-	// 0 is not a valid event RQID
-	ec->events.handler[rqid - 1].handler = fn;
-	ec->events.handler[rqid - 1].delay = delay;
-	ec->events.handler[rqid - 1].data = data;
+	surface_sam_ssh_release_shared(ec);
 
-	spin_unlock_irqrestore(&ec->events.lock, flags);
-	surface_sam_ssh_release(ec);
+	/*
+	 * Make sure that the receiver does not see the subscriber any more,
+	 * drop its events that have not been started yet, and wait for the
+	 * ones that have. Events of other subscribers are not waited for.
+	 */
+	synchronize_rcu();
+	ssh_event_cancel(ec, sub);
+	wait_event(ec->events.waitq, !atomic_read(&sub->pending));
 
 	return 0;
 }
-EXPORT_SYMBOL_GPL(surface_sam_ssh_set_delayed_event_handler);
+EXPORT_SYMBOL_GPL(surface_sam_ssh_event_unsubscribe);
 
-int surface_sam_ssh_remove_event_handler(u16 rqid)
+int surface_sam_ssh_cache_rule_add(struct surface_sam_ssh_cache_rule *rule)
 {
 	struct sam_ssh_ec *ec;
 	unsigned long flags;
 
-	if (!sam_rqid_is_event(rqid)) {
-		return -EINVAL;
+	ec = surface_sam_ssh_acquire_shared_init();
+	if (!ec) {
+		return -ENXIO;
 	}
 
-	ec = surface_sam_ssh_acquire_init();
+	spin_lock_irqsave(&ec->cache.lock, flags);
+	list_add_tail(&rule->node, &ec->cache.rules);
+	spin_unlock_irqrestore(&ec->cache.lock, flags);
+
+	surface_sam_ssh_release_shared(ec);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_cache_rule_add);
+
+int surface_sam_ssh_cache_rule_remove(struct surface_sam_ssh_cache_rule *rule)
+{
+	struct sam_ssh_ec *ec;
+	unsigned long flags;
+
+	ec = surface_sam_ssh_acquire_shared_init();
 	if (!ec) {
 		return -ENXIO;
 	}
 
-	spin_lock_irqsave(&ec->events.lock, flags);
+	spin_lock_irqsave(&ec->cache.lock, flags);
+	list_del(&rule->node);
+	spin_unlock_irqrestore(&ec->cache.lock, flags);
 
-	// 0 is not a valid event RQID
-	ec->events.handler[rqid - 1].handler = NULL;
-	ec->events.handler[rqid - 1].delay = NULL;
-	ec->events.handler[rqid - 1].data = NULL;
+	surface_sam_ssh_release_shared(ec);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_cache_rule_remove);
 
-	spin_unlock_irqrestore(&ec->events.lock, flags);
-	surface_sam_ssh_release(ec);
 
-	/*
-	 * Make sure that the handler is not in use any more after we've
-	 * removed it.
-	 */
-	flush_workqueue(ec->events.queue_evt);
+/*
+ * CRC-CCITT (polynomial 0x1021, MSB first, as crc_ccitt_false) using
+ * slice-by-8 tables: table[k][b] is the CRC contribution of byte b followed
+ * by k zero bytes. This processes eight bytes per step instead of one.
+ */
+static u16 ssh_crc_table[8][256];
 
-	return 0;
+static void ssh_crc_init(void)
+{
+	u16 crc;
+	int i, j, k;
+
+	for (i = 0; i < 256; i++) {
+		crc = i << 8;
+		for (j = 0; j < 8; j++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+		ssh_crc_table[0][i] = crc;
+	}
+
+	for (k = 1; k < 8; k++) {
+		for (i = 0; i < 256; i++) {
+			crc = ssh_crc_table[k - 1][i];
+			ssh_crc_table[k][i] = (crc << 8) ^ ssh_crc_table[0][crc >> 8];
+		}
+	}
 }
-EXPORT_SYMBOL_GPL(surface_sam_ssh_remove_event_handler);
 
+static u16 ssh_crc_update(u16 crc, const u8 *buf, size_t size)
+{
+	const u16 (*t)[256] = ssh_crc_table;
+
+	for (; size >= 8; size -= 8, buf += 8) {
+		crc = t[7][buf[0] ^ (crc >> 8)] ^ t[6][buf[1] ^ (crc & 0xff)]
+		    ^ t[5][buf[2]] ^ t[4][buf[3]] ^ t[3][buf[4]]
+		    ^ t[2][buf[5]] ^ t[1][buf[6]] ^ t[0][buf[7]];
+	}
+
+	for (; size > 0; size--, buf++) {
+		crc = (crc << 8) ^ t[0][(crc >> 8) ^ *buf];
+	}
+
+	return crc;
+}
 
 inline static u16 ssh_crc(const u8 *buf, size_t size)
 {
-	return crc_ccitt_false(0xffff, buf, size);
+	return ssh_crc_update(0xffff, buf, size);
 }
 
 inline static void ssh_write_u16(struct ssh_writer *writer, u16 in)
@@ -502,7 +899,7 @@ inline static void ssh_write_buf(struct ssh_writer *writer,
 
 inline static void ssh_write_hdr(struct ssh_writer *writer,
 				 const struct surface_sam_ssh_rqst *rqst,
-				 struct sam_ssh_ec *ec)
+				 const struct ssh_request *rq)
 {
 	struct ssh_frame_ctrl *hdr = (struct ssh_frame_ctrl *)writer->ptr;
 	u8 *begin = writer->ptr;
@@ -510,7 +907,7 @@ inline static void ssh_write_hdr(struct ssh_writer *writer,
 	hdr->type = SSH_FRAME_TYPE_CMD;
 	hdr->len  = SSH_BYTELEN_CMDFRAME + rqst->cdl;	// without CRC
 	hdr->pad  = 0x00;
-	hdr->seq  = ec->counter.seq;
+	hdr->seq  = rq->seq;
 
 	writer->ptr += sizeof(*hdr);
 
@@ -519,14 +916,13 @@ inline static void ssh_write_hdr(struct ssh_writer *writer,
 
 inline static void ssh_write_cmd(struct ssh_writer *writer,
 				 const struct surface_sam_ssh_rqst *rqst,
-				 struct sam_ssh_ec *ec)
+				 const struct ssh_request *rq)
 {
 	struct ssh_frame_cmd *cmd = (struct ssh_frame_cmd *)writer->ptr;
 	u8 *begin = writer->ptr;
 
-	u16 rqid = sam_rqid_to_rqst(ec->counter.rqid);
-	u8 rqid_lo = rqid & 0xFF;
-	u8 rqid_hi = rqid >> 8;
+	u8 rqid_lo = rq->rqid & 0xFF;
+	u8 rqid_hi = rq->rqid >> 8;
 
 	cmd->type     = SSH_FRAME_TYPE_CMD;
 	cmd->tc       = rqst->tc;
@@ -560,422 +956,2498 @@ inline static void ssh_write_ack(struct ssh_writer *writer, u8 seq)
 
 inline static void ssh_writer_reset(struct ssh_writer *writer)
 {
-	writer->ptr = writer->data;
+	writer->ptr  = writer->data;
+	writer->head = writer->data;
 }
 
-inline static int ssh_writer_flush(struct sam_ssh_ec *ec)
+inline static bool ssh_writer_busy(const struct ssh_writer *writer)
 {
-	struct ssh_writer *writer = &ec->writer;
-	struct serdev_device *serdev = ec->serdev;
-	int status;
+	return writer->ptr != writer->data;
+}
 
-	size_t len = writer->ptr - writer->data;
+inline static void ssh_writer_start(struct sam_ssh_ec *ec)
+{
+	struct ssh_writer *writer = &ec->writer;
 
 	dev_dbg(&ec->serdev->dev, "sending message\n");
 	print_hex_dump_debug("send: ", DUMP_PREFIX_OFFSET, 16, 1,
 	                     writer->data, writer->ptr - writer->data, false);
 
-	status = serdev_device_write(serdev, writer->data, len, SSH_WRITE_TIMEOUT);
-	return status >= 0 ? 0 : status;
+	writer->head = writer->data;
+	writer->deadline = jiffies + SSH_WRITE_TIMEOUT;
 }
 
-inline static void ssh_write_msg_cmd(struct sam_ssh_ec *ec,
-				     const struct surface_sam_ssh_rqst *rqst)
+/*
+ * Hand as much of the buffer to the UART as it takes, without blocking.
+ * Returns zero once everything has been written, -EAGAIN if the rest has to
+ * wait for write_wakeup.
+ */
+inline static int ssh_writer_push(struct sam_ssh_ec *ec)
 {
-	ssh_writer_reset(&ec->writer);
-	ssh_write_syn(&ec->writer);
-	ssh_write_hdr(&ec->writer, rqst, ec);
-	ssh_write_cmd(&ec->writer, rqst, ec);
-}
+	struct ssh_writer *writer = &ec->writer;
+	int n;
+
+	n = serdev_device_write_buf(ec->serdev, writer->head, writer->ptr - writer->head);
+	if (n < 0) {
+		return n;
+	}
+
+	writer->head += n;
+	return writer->head == writer->ptr ? 0 : -EAGAIN;
+}
+
+inline static void ssh_write_msg_cmd(struct sam_ssh_ec *ec,
+				     const struct ssh_request *rq)
+{
+	ssh_write_syn(&ec->writer);
+	ssh_write_hdr(&ec->writer, &rq->rqst, rq);
+	ssh_write_cmd(&ec->writer, &rq->rqst, rq);
+}
 
 inline static void ssh_write_msg_ack(struct sam_ssh_ec *ec, u8 seq)
 {
-	ssh_writer_reset(&ec->writer);
 	ssh_write_syn(&ec->writer);
 	ssh_write_ack(&ec->writer, seq);
 	ssh_write_ter(&ec->writer);
 }
 
-inline static void ssh_receiver_restart(struct sam_ssh_ec *ec,
-					const struct surface_sam_ssh_rqst *rqst)
+/*
+ * Queue an ACK for the given sequence ID. Must only be called from the
+ * receiver, which is the sole producer of the ACK queue.
+ */
+static void ssh_queue_ack(struct sam_ssh_ec *ec, u8 seq)
 {
-	unsigned long flags;
+	if (!kfifo_put(&ec->writer.ack, seq)) {
+		dev_warn(&ec->serdev->dev, SSH_RECV_TAG "ACK queue full, dropping ACK\n");
+		return;
+	}
 
-	spin_lock_irqsave(&ec->receiver.lock, flags);
-	reinit_completion(&ec->receiver.signal);
-	ec->receiver.state = SSH_RCV_CONTROL;
-	ec->receiver.expect.pld = rqst->snc;
-	ec->receiver.expect.seq = ec->counter.seq;
-	ec->receiver.expect.rqid = sam_rqid_to_rqst(ec->counter.rqid);
-	ec->receiver.eval_buf.len = 0;
-	spin_unlock_irqrestore(&ec->receiver.lock, flags);
+	queue_work(ec->pending.queue_tx, &ec->writer.work);
 }
 
-inline static void ssh_receiver_discard(struct sam_ssh_ec *ec)
-{
-	unsigned long flags;
 
-	spin_lock_irqsave(&ec->receiver.lock, flags);
-	ec->receiver.state = SSH_RCV_DISCARD;
-	ec->receiver.eval_buf.len = 0;
-	kfifo_reset(&ec->receiver.fifo);
-	spin_unlock_irqrestore(&ec->receiver.lock, flags);
+inline static int ssh_pending_index(u16 rqid)
+{
+	return (rqid >> SURFACE_SAM_SSH_RQID_EVENT_BITS) & (SSH_PENDING_MAX - 1);
 }
 
-static int surface_sam_ssh_rqst_unlocked(struct sam_ssh_ec *ec,
-					 const struct surface_sam_ssh_rqst *rqst,
-					 struct surface_sam_ssh_buf *result)
+static bool ssh_pending_insert(struct sam_ssh_ec *ec, struct ssh_request *rq)
 {
-	struct device *dev = &ec->serdev->dev;
-	struct ssh_fifo_packet packet = {};
-	int status;
-	int try;
-	unsigned int rem;
+	struct ssh_pending *pending = &ec->pending;
+	u16 rqid;
+	int i;
 
-	if (rqst->cdl > SURFACE_SAM_SSH_MAX_RQST_PAYLOAD) {
-		dev_err(dev, SSH_RQST_TAG "request payload too large\n");
-		return -EINVAL;
+	/*
+	 * Allocate the next RQID with a free slot. Skipping RQIDs of slots
+	 * still in use is fine, the EC only matches responses by RQID.
+	 */
+	for (i = 0; i < SSH_PENDING_MAX; i++) {
+		rqid = sam_rqid_to_rqst(ec->counter.rqid);
+		ec->counter.rqid += 1;
+
+		if (!pending->slot[ssh_pending_index(rqid)]) {
+			rq->rqid = rqid;
+			pending->slot[ssh_pending_index(rqid)] = rq;
+			return true;
+		}
 	}
 
-	// write command in buffer, we may need it multiple times
-	ssh_write_msg_cmd(ec, rqst);
-	ssh_receiver_restart(ec, rqst);
+	return false;
+}
 
-	// send command, try to get an ack response
-	for (try = 0; try < SSH_NUM_RETRY; try++) {
-		status = ssh_writer_flush(ec);
-		if (status) {
-			goto out;
-		}
+inline static void ssh_pending_remove(struct sam_ssh_ec *ec, struct ssh_request *rq)
+{
+	ec->pending.slot[ssh_pending_index(rq->rqid)] = NULL;
+	rq->state = SSH_RQST_COMPLETED;
+}
+
+static bool ssh_pending_idle(struct sam_ssh_ec *ec)
+{
+	unsigned long flags;
+	bool idle = true;
+	int i;
 
-		rem = wait_for_completion_timeout(&ec->receiver.signal, SSH_READ_TIMEOUT);
-		if (rem) {
-			// completion assures valid packet, thus ignore returned length
-			(void) !kfifo_out(&ec->receiver.fifo, &packet, sizeof(packet));
+	spin_lock_irqsave(&ec->pending.lock, flags);
 
-			if (packet.type == SSH_FRAME_TYPE_ACK) {
-				break;
-			}
-		}
+	for (i = 0; i < SURFACE_SAM_SSH_RQST_PRIO_NUM && idle; i++) {
+		idle = list_empty(&ec->pending.queue[i]);
 	}
 
-	// check if we ran out of tries?
-	if (try >= SSH_NUM_RETRY) {
-		dev_err(dev, SSH_RQST_TAG "communication failed %d times, giving up\n", try);
-		status = -EIO;
-		goto out;
+	for (i = 0; i < SSH_PENDING_MAX && idle; i++) {
+		idle = !ec->pending.slot[i];
 	}
 
-	ec->counter.seq  += 1;
-	ec->counter.rqid += 1;
+	spin_unlock_irqrestore(&ec->pending.lock, flags);
+	return idle;
+}
 
-	// get command response/payload
-	if (rqst->snc && result) {
-		rem = wait_for_completion_timeout(&ec->receiver.signal, SSH_READ_TIMEOUT);
-		if (rem) {
-			// completion assures valid packet, thus ignore returned length
-			(void) !kfifo_out(&ec->receiver.fifo, &packet, sizeof(packet));
+inline static void ssh_pending_wait_idle(struct sam_ssh_ec *ec)
+{
+	wait_event(ec->pending.waitq, ssh_pending_idle(ec));
+}
 
-			if (result->cap < packet.len) {
-				status = -EINVAL;
-				goto out;
-			}
+static void ssh_rtt_sample(struct ssh_rtt *rtt, ktime_t start, ktime_t end)
+{
+	u32 r = min_t(s64, ktime_us_delta(end, start), U32_MAX);
+	u32 delta;
 
-			// completion assures valid packet, thus ignore returned length
-			(void) !kfifo_out(&ec->receiver.fifo, result->data, packet.len);
-			result->len = packet.len;
-		} else {
-			dev_err(dev, SSH_RQST_TAG "communication timed out\n");
-			status = -EIO;
-			goto out;
-		}
+	if (!rtt->samples) {
+		rtt->srtt   = r;
+		rtt->rttvar = r / 2;
+	} else {
+		delta = rtt->srtt > r ? rtt->srtt - r : r - rtt->srtt;
 
-		// send ACK
-		ssh_write_msg_ack(ec, packet.seq);
-		status = ssh_writer_flush(ec);
-		if (status) {
-			goto out;
-		}
+		rtt->rttvar = (3 * rtt->rttvar + delta) / 4;
+		rtt->srtt   = (7 * rtt->srtt + r) / 8;
 	}
 
-out:
-	ssh_receiver_discard(ec);
-	return status;
+	rtt->samples += 1;
 }
 
-int surface_sam_ssh_rqst(const struct surface_sam_ssh_rqst *rqst, struct surface_sam_ssh_buf *result)
+inline static u32 ssh_rtt_rto_us(const struct ssh_rtt *rtt)
 {
-	struct sam_ssh_ec *ec;
-	int status;
-
-	ec = surface_sam_ssh_acquire_init();
-	if (!ec) {
-		printk(KERN_WARNING SSH_RQST_TAG_FULL "embedded controller is uninitialized\n");
-		return -ENXIO;
+	if (!rtt->samples) {
+		return SSH_RTO_MAX_US;
 	}
 
-	if (ec->state == SSH_EC_SUSPENDED) {
-		dev_warn(&ec->serdev->dev, SSH_RQST_TAG "embedded controller is suspended\n");
+	return clamp_t(u32, rtt->srtt + max_t(u32, SSH_RTO_GRANULARITY_US, 4 * rtt->rttvar),
+		       SSH_RTO_MIN_US, SSH_RTO_MAX_US);
+}
 
-		surface_sam_ssh_release(ec);
-		return -EPERM;
+/*
+ * Re-transmission timeout, i.e. how long to wait for an ACK. Backed off
+ * exponentially on each timeout until the next valid sample.
+ */
+static unsigned long ssh_rto_ack(struct sam_ssh_ec *ec)
+{
+	u64 rto = (u64)ssh_rtt_rto_us(&ec->rtt.ack) << ec->rtt.backoff;
+
+	return usecs_to_jiffies(min_t(u64, rto, SSH_RTO_MAX_US));
+}
+
+static void ssh_reaper_arm(struct sam_ssh_ec *ec, unsigned long expires)
+{
+	struct ssh_pending *pending = &ec->pending;
+	unsigned long now = jiffies;
+
+	if (pending->reaper_armed && time_before_eq(pending->reaper_expires, expires)) {
+		return;
 	}
 
-	status = surface_sam_ssh_rqst_unlocked(ec, rqst, result);
+	pending->reaper_expires = expires;
+	pending->reaper_armed = true;
 
-	surface_sam_ssh_release(ec);
-	return status;
+	mod_delayed_work(pending->queue_tx, &pending->reaper,
+			 time_after(expires, now) ? expires - now : 0);
 }
-EXPORT_SYMBOL_GPL(surface_sam_ssh_rqst);
 
 
-static int surface_sam_ssh_ec_resume(struct sam_ssh_ec *ec)
+inline static bool ssh_request_cacheable(const struct ssh_request *rq)
 {
-	u8 buf[1] = { 0x00 };
+	return (rq->rqst.flags & SURFACE_SAM_SSH_RQST_IDEMPOTENT)
+	    && rq->rqst.ttl && rq->expect_rsp
+	    && rq->rqst.cdl <= SSH_CACHE_KEY_PLD;
+}
 
-	struct surface_sam_ssh_rqst rqst = {
-		.tc  = 0x01,
-		.iid = 0x00,
-		.cid = 0x16,
-		.snc = 0x01,
-		.cdl = 0x00,
-		.pld = NULL,
-	};
+inline static bool ssh_cache_entry_match(const struct ssh_cache_entry *e,
+					 const struct ssh_request *rq)
+{
+	return e->valid
+	    && e->tc  == rq->rqst.tc
+	    && e->iid == rq->rqst.iid
+	    && e->cid == rq->rqst.cid
+	    && e->cdl == rq->rqst.cdl
+	    && !memcmp(e->pld, rq->pld, e->cdl);
+}
 
-	struct surface_sam_ssh_buf result = {
-		result.cap = ARRAY_SIZE(buf),
-		result.len = 0,
-		result.data = buf,
-	};
+/*
+ * Look up the response to rq and copy it to the result buffer of rq.
+ * Returns true on hit. Also records the cache generation for storing the
+ * response on miss.
+ */
+static bool ssh_cache_lookup(struct ssh_cache *cache, struct ssh_request *rq)
+{
+	struct ssh_cache_entry *e;
+	unsigned long flags;
+	bool hit = false;
+	int i;
 
-	int status = surface_sam_ssh_rqst_unlocked(ec, &rqst, &result);
-	if (status) {
-		return status;
+	spin_lock_irqsave(&cache->lock, flags);
+
+	rq->cache_gen = cache->generation[rq->rqst.tc];
+
+	for (i = 0; i < SSH_CACHE_SIZE; i++) {
+		e = &cache->entry[i];
+		if (!ssh_cache_entry_match(e, rq)) {
+			continue;
+		}
+
+		if (time_after_eq(jiffies, e->expires)) {
+			e->valid = false;
+			break;
+		}
+
+		// let the EC request report a result buffer too small
+		if (rq->result && rq->result->cap >= e->len) {
+			memcpy(rq->result->data, e->data, e->len);
+			rq->result->len = e->len;
+			hit = true;
+		}
+		break;
 	}
 
-	if (buf[0] != 0x00) {
-		dev_warn(&ec->serdev->dev,
-		         "unexpected result while trying to resume EC: 0x%02x\n",
-			 buf[0]);
+	if (hit) {
+		cache->hits[rq->rqst.tc] += 1;
+	} else {
+		cache->misses[rq->rqst.tc] += 1;
 	}
 
-	return 0;
+	spin_unlock_irqrestore(&cache->lock, flags);
+	return hit;
 }
 
-static int surface_sam_ssh_ec_suspend(struct sam_ssh_ec *ec)
+/*
+ * Store the response to rq, replacing the entry of the same key, an invalid
+ * entry, or the entry expiring first, in that order.
+ */
+static void ssh_cache_store(struct ssh_cache *cache, const struct ssh_request *rq,
+			    const u8 *pld, size_t len)
 {
-	u8 buf[1] = { 0x00 };
+	struct ssh_cache_entry *victim = NULL;
+	struct ssh_cache_entry *e;
+	unsigned long flags;
+	int i;
 
-	struct surface_sam_ssh_rqst rqst = {
-		.tc  = 0x01,
-		.iid = 0x00,
-		.cid = 0x15,
-		.snc = 0x01,
-		.cdl = 0x00,
-		.pld = NULL,
-	};
+	if (len > SURFACE_SAM_SSH_MAX_RQST_RESPONSE) {
+		return;
+	}
 
-	struct surface_sam_ssh_buf result = {
-		result.cap = ARRAY_SIZE(buf),
-		result.len = 0,
-		result.data = buf,
-	};
+	spin_lock_irqsave(&cache->lock, flags);
 
-	int status = surface_sam_ssh_rqst_unlocked(ec, &rqst, &result);
-	if (status) {
-		return status;
+	if (rq->cache_gen != cache->generation[rq->rqst.tc]) {
+		goto out;
 	}
 
-	if (buf[0] != 0x00) {
-		dev_warn(&ec->serdev->dev,
-		         "unexpected result while trying to suspend EC: 0x%02x\n",
-			 buf[0]);
+	for (i = 0; i < SSH_CACHE_SIZE; i++) {
+		e = &cache->entry[i];
+
+		if (ssh_cache_entry_match(e, rq)) {
+			victim = e;
+			break;
+		}
+
+		if (victim && !victim->valid) {
+			continue;
+		}
+
+		if (!victim || !e->valid || time_before(e->expires, victim->expires)) {
+			victim = e;
+		}
 	}
 
-	return 0;
+	victim->valid   = true;
+	victim->expires = jiffies + msecs_to_jiffies(rq->rqst.ttl);
+	victim->tc      = rq->rqst.tc;
+	victim->iid     = rq->rqst.iid;
+	victim->cid     = rq->rqst.cid;
+	victim->cdl     = rq->rqst.cdl;
+	victim->len     = len;
+	memcpy(victim->pld, rq->pld, rq->rqst.cdl);
+	memcpy(victim->data, pld, len);
+
+out:
+	spin_unlock_irqrestore(&cache->lock, flags);
 }
 
+static u32 ssh_cache_generation(struct ssh_cache *cache, u8 tc)
+{
+	unsigned long flags;
+	u32 gen;
 
-inline static bool ssh_is_valid_syn(const u8 *ptr)
+	spin_lock_irqsave(&cache->lock, flags);
+	gen = cache->generation[tc];
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	return gen;
+}
+
+// must be called with the cache lock held
+static void __ssh_cache_invalidate(struct ssh_cache *cache, u8 tc)
 {
-	return ptr[0] == 0xaa && ptr[1] == 0x55;
+	int i;
+
+	cache->generation[tc] += 1;
+
+	for (i = 0; i < SSH_CACHE_SIZE; i++) {
+		if (cache->entry[i].valid && cache->entry[i].tc == tc) {
+			cache->entry[i].valid = false;
+			cache->invalidated[tc] += 1;
+		}
+	}
 }
 
-inline static bool ssh_is_valid_ter(const u8 *ptr)
+static void ssh_cache_invalidate(struct ssh_cache *cache, u8 tc)
 {
-	return ptr[0] == 0xff && ptr[1] == 0xff;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	__ssh_cache_invalidate(cache, tc);
+	spin_unlock_irqrestore(&cache->lock, flags);
 }
 
-inline static bool ssh_is_valid_crc(const u8 *begin, const u8 *end)
+static void ssh_cache_invalidate_all(struct ssh_cache *cache)
+{
+	unsigned long flags;
+	int tc;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	for (tc = 0; tc < SSH_NUM_TC; tc++) {
+		__ssh_cache_invalidate(cache, tc);
+	}
+	spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+// apply the invalidation rules for an event of the given target category
+static void ssh_cache_event(struct ssh_cache *cache, u8 tc)
 {
-	u16 crc = ssh_crc(begin, end - begin);
-	return (end[0] == (crc & 0xff)) && (end[1] == (crc >> 8));
+	struct surface_sam_ssh_cache_rule *rule;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	list_for_each_entry(rule, &cache->rules, node) {
+		if (rule->event_tc == tc) {
+			__ssh_cache_invalidate(cache, rule->rqst_tc);
+		}
+	}
+	spin_unlock_irqrestore(&cache->lock, flags);
 }
 
 
-static int surface_sam_ssh_send_ack(struct sam_ssh_ec *ec, u8 seq)
+inline static void ssh_request_put(struct ssh_request *rq)
 {
-	int status;
-	u8 buf[SSH_MSG_LEN_CTRL];
-	u16 crc;
+	if (refcount_dec_and_test(&rq->refcount)) {
+		kfree(rq);
+	}
+}
+
+static void ssh_request_finish(struct ssh_request *rq, int status,
+			       const u8 *pld, size_t len)
+{
+	if (!status && pld && rq->result) {
+		if (rq->result->cap >= len) {
+			memcpy(rq->result->data, pld, len);
+			rq->result->len = len;
+		} else {
+			status = -EINVAL;
+		}
+	}
 
-	buf[0] = 0xaa;
-	buf[1] = 0x55;
-	buf[2] = 0x40;
-	buf[3] = 0x00;
-	buf[4] = 0x00;
-	buf[5] = seq;
+	if (rq->complete) {
+		rq->complete(status, rq->result, rq->complete_data);
+	}
 
-	crc = ssh_crc(buf + SSH_FRAME_OFFS_CTRL, SSH_BYTELEN_CTRL);
-	buf[6] = crc & 0xff;
-	buf[7] = crc >> 8;
+	ssh_request_put(rq);
+}
 
-	buf[8] = 0xff;
-	buf[9] = 0xff;
+/*
+ * Complete a request that has already been removed from queue and pending
+ * table, along with its followers. The response payload pld may be NULL if
+ * there is none. May be called from atomic context.
+ */
+static void ssh_request_complete_rsp(struct ssh_request *rq, int status,
+				     const u8 *pld, size_t len)
+{
+	struct sam_ssh_ec *ec = rq->ec;
+	struct ssh_request *f, *n;
 
-	dev_dbg(&ec->serdev->dev, "sending message\n");
-	print_hex_dump_debug("send: ", DUMP_PREFIX_OFFSET, 16, 1,
-	                     buf, SSH_MSG_LEN_CTRL, false);
+	// only cache responses that are delivered to the caller (see below)
+	if (!status && pld && ssh_request_cacheable(rq)
+	    && (!rq->result || rq->result->cap >= len)) {
+		ssh_cache_store(&ec->cache, rq, pld, len);
+	}
 
-	status = serdev_device_write(ec->serdev, buf, SSH_MSG_LEN_CTRL, SSH_WRITE_TIMEOUT);
-	return status >= 0 ? 0 : status;
+	/*
+	 * The request has been removed from the pending table, so no new
+	 * followers can be added and we can access the list without lock.
+	 */
+	list_for_each_entry_safe(f, n, &rq->followers, node) {
+		list_del(&f->node);
+		ssh_request_finish(f, status, pld, len);
+	}
+
+	ssh_request_finish(rq, status, pld, len);
+
+	// a slot has been freed, wake up transmitter and idle waiters
+	queue_work(ec->pending.queue_tx, &ec->writer.work);
+	wake_up(&ec->pending.waitq);
 }
 
-static void surface_sam_ssh_event_work_ack_handler(struct work_struct *_work)
+inline static void ssh_request_complete(struct ssh_request *rq, int status)
 {
-	struct surface_sam_ssh_event *event;
-	struct ssh_event_work *work;
-	struct sam_ssh_ec *ec;
-	struct device *dev;
-	int status;
+	ssh_request_complete_rsp(rq, status, NULL, 0);
+}
 
-	work = container_of(_work, struct ssh_event_work, work_ack);
-	event = &work->event;
-	ec = work->ec;
-	dev = &ec->serdev->dev;
 
-	// make sure we load a fresh ec state
-	smp_mb();
+static const u8 ssh_rqst_prio_order[] = {
+	SURFACE_SAM_SSH_RQST_PRIO_INTERACTIVE,
+	SURFACE_SAM_SSH_RQST_PRIO_NORMAL,
+	SURFACE_SAM_SSH_RQST_PRIO_BACKGROUND,
+};
 
-	if (ec->state == SSH_EC_INITIALIZED) {
-		status = surface_sam_ssh_send_ack(ec, work->seq);
-		if (status) {
-			dev_err(dev, SSH_EVENT_TAG "failed to send ACK: %d\n", status);
+static const char *const ssh_rqst_prio_name[] = {
+	[SURFACE_SAM_SSH_RQST_PRIO_NORMAL]      = "normal",
+	[SURFACE_SAM_SSH_RQST_PRIO_INTERACTIVE] = "interactive",
+	[SURFACE_SAM_SSH_RQST_PRIO_BACKGROUND]  = "background",
+};
+
+/*
+ * Select the next queued request: the head of the highest class with
+ * requests queued. Heads that have waited for longer than the aging limit
+ * take precedence over that, oldest first.
+ */
+static struct ssh_request *ssh_pending_next(struct ssh_pending *pending, ktime_t now,
+					    bool *aged)
+{
+	struct ssh_request *next = NULL;
+	struct ssh_request *old = NULL;
+	struct ssh_request *rq;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ssh_rqst_prio_order); i++) {
+		rq = list_first_entry_or_null(&pending->queue[ssh_rqst_prio_order[i]],
+					      struct ssh_request, node);
+		if (!rq) {
+			continue;
+		}
+
+		if (!next) {
+			next = rq;
+		}
+
+		if (ktime_ms_delta(now, rq->queued) < SSH_RQST_AGING_MS) {
+			continue;
+		}
+
+		if (!old || ktime_before(rq->queued, old->queued)) {
+			old = rq;
 		}
 	}
 
-	if (refcount_dec_and_test(&work->refcount)) {
-		kfree(work);
+	*aged = old && old != next;
+	return old ? old : next;
+}
+
+inline static bool ssh_request_is_same(const struct ssh_request *a,
+				       const struct ssh_request *b)
+{
+	return a->rqst.tc  == b->rqst.tc
+	    && a->rqst.iid == b->rqst.iid
+	    && a->rqst.cid == b->rqst.cid
+	    && a->rqst.snc == b->rqst.snc
+	    && a->rqst.cdl == b->rqst.cdl
+	    && a->cache_gen == b->cache_gen
+	    && !memcmp(a->pld, b->pld, a->rqst.cdl);
+}
+
+/*
+ * Find a queued or pending request the idempotent request rq can share the
+ * transaction with. The leader must have been submitted in the same cache
+ * generation, i.e. without a non-idempotent request to the same target
+ * category in between, so that reads following a write see its effect. Must
+ * be called with the pending-table lock held.
+ */
+static struct ssh_request *ssh_pending_leader(struct ssh_pending *pending,
+					      struct ssh_request *rq)
+{
+	struct ssh_request *p;
+	int i;
+
+	if (!(rq->rqst.flags & SURFACE_SAM_SSH_RQST_IDEMPOTENT)) {
+		return NULL;
+	}
+
+	for (i = 0; i < SSH_PENDING_MAX; i++) {
+		p = pending->slot[i];
+		if (p && (p->rqst.flags & SURFACE_SAM_SSH_RQST_IDEMPOTENT)
+		    && ssh_request_is_same(p, rq)) {
+			return p;
+		}
+	}
+
+	for (i = 0; i < SURFACE_SAM_SSH_RQST_PRIO_NUM; i++) {
+		list_for_each_entry(p, &pending->queue[i], node) {
+			if ((p->rqst.flags & SURFACE_SAM_SSH_RQST_IDEMPOTENT)
+			    && ssh_request_is_same(p, rq)) {
+				return p;
+			}
+		}
 	}
+
+	return NULL;
 }
 
-static void surface_sam_ssh_event_work_evt_handler(struct work_struct *_work)
+/*
+ * Add rq to the followers of leader. A queued leader is moved up to the
+ * class of rq if that is higher, so that rq does not wait longer than it
+ * would have on its own. Must be called with the pending-table lock held.
+ */
+static void ssh_pending_follow(struct ssh_pending *pending, struct ssh_request *leader,
+			       struct ssh_request *rq)
 {
-	struct delayed_work *dwork = (struct delayed_work *)_work;
-	struct ssh_event_work *work;
-	struct surface_sam_ssh_event *event;
-	struct sam_ssh_ec *ec;
-	struct device *dev;
-	unsigned long flags;
+	int i;
 
-	surface_sam_ssh_event_handler_fn handler;
-	void *handler_data;
+	list_add_tail(&rq->node, &leader->followers);
+	rq->state = SSH_RQST_SHARED;
+	pending->shared += 1;
 
-	int status = 0;
+	if (leader->state != SSH_RQST_QUEUED) {
+		return;
+	}
 
-	work = container_of(dwork, struct ssh_event_work, work_evt);
-	event = &work->event;
-	ec = work->ec;
-	dev = &ec->serdev->dev;
+	for (i = 0; i < ARRAY_SIZE(ssh_rqst_prio_order); i++) {
+		if (ssh_rqst_prio_order[i] == leader->rqst.prio) {
+			return;
+		}
+
+		if (ssh_rqst_prio_order[i] == rq->rqst.prio) {
+			break;
+		}
+	}
+
+	pending->class[leader->rqst.prio].depth -= 1;
+	leader->rqst.prio = rq->rqst.prio;
+	list_move_tail(&leader->node, &pending->queue[leader->rqst.prio]);
+
+	pending->class[leader->rqst.prio].depth += 1;
+	pending->class[leader->rqst.prio].depth_max =
+		max(pending->class[leader->rqst.prio].depth_max,
+		    pending->class[leader->rqst.prio].depth);
+}
+
+typedef bool (*ssh_request_match_fn)(const struct ssh_request *rq, void *arg);
+
+static struct ssh_request *ssh_pending_find_followers(struct ssh_request *leader,
+						      ssh_request_match_fn match,
+						      void *arg)
+{
+	struct ssh_request *rq;
+
+	if (match(leader, arg)) {
+		return leader;
+	}
+
+	list_for_each_entry(rq, &leader->followers, node) {
+		if (match(rq, arg)) {
+			return rq;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Find a queued, pending, or shared request for which match returns true.
+ * Must be called with the pending-table lock held.
+ */
+static struct ssh_request *ssh_pending_find(struct ssh_pending *pending,
+					    ssh_request_match_fn match, void *arg)
+{
+	struct ssh_request *leader, *rq;
+	int i;
+
+	for (i = 0; i < SSH_PENDING_MAX; i++) {
+		leader = pending->slot[i];
+		if (!leader) {
+			continue;
+		}
+
+		rq = ssh_pending_find_followers(leader, match, arg);
+		if (rq) {
+			return rq;
+		}
+	}
+
+	for (i = 0; i < SURFACE_SAM_SSH_RQST_PRIO_NUM; i++) {
+		list_for_each_entry(leader, &pending->queue[i], node) {
+			rq = ssh_pending_find_followers(leader, match, arg);
+			if (rq) {
+				return rq;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Take a queued, pending, or shared request out of the transport and add it
+ * to the given list, to be completed by the caller. If the request has
+ * followers, the transaction is kept alive: the first follower takes over
+ * the caller-specific fields of the request and is taken out in its place.
+ * Must be called with the pending-table lock held.
+ */
+static void ssh_pending_drop(struct sam_ssh_ec *ec, struct ssh_request *rq,
+			     struct list_head *dropped)
+{
+	struct ssh_pending *pending = &ec->pending;
+	struct ssh_request *f;
+
+	f = list_first_entry_or_null(&rq->followers, struct ssh_request, node);
+	if (f) {
+		list_del(&f->node);
+
+		swap(rq->result, f->result);
+		swap(rq->complete, f->complete);
+		swap(rq->complete_data, f->complete_data);
+		swap(rq->rqst.timeout, f->rqst.timeout);
+		swap(rq->deadline, f->deadline);
+
+		list_add_tail(&f->node, dropped);
+		return;
+	}
+
+	switch (rq->state) {
+	case SSH_RQST_QUEUED:
+		pending->class[rq->rqst.prio].depth -= 1;
+		rq->state = SSH_RQST_COMPLETED;
+		list_move_tail(&rq->node, dropped);
+		break;
+
+	case SSH_RQST_SHARED:
+		list_move_tail(&rq->node, dropped);
+		break;
+
+	case SSH_RQST_PENDING_ACK:
+	case SSH_RQST_PENDING_RSP:
+		// a frame still being written is released in ssh_tx_finish
+		ssh_pending_remove(ec, rq);
+		list_add_tail(&rq->node, dropped);
+		break;
+
+	case SSH_RQST_COMPLETED:
+		WARN_ON(1);
+		break;
+	}
+}
+
+// take out all requests for which match returns true
+static int ssh_pending_drop_matching(struct sam_ssh_ec *ec,
+				     ssh_request_match_fn match, void *arg,
+				     struct list_head *dropped)
+{
+	struct ssh_request *rq;
+	int n = 0;
+
+	while ((rq = ssh_pending_find(&ec->pending, match, arg))) {
+		ssh_pending_drop(ec, rq, dropped);
+		n += 1;
+	}
+
+	return n;
+}
+
+/*
+ * Collect the next burst of command frames to be sent with a single write.
+ * Frames are matched to their ACK via the sequence ID, thus multiple frames
+ * may wait for their ACK at the same time. A RETRY frame however carries no
+ * sequence ID and causes all unacknowledged frames to be re-sent, so new
+ * frames are only added once the previous burst has been acknowledged.
+ */
+static int ssh_tx_collect(struct sam_ssh_ec *ec, struct ssh_request **burst,
+			  struct list_head *failed)
+{
+	struct ssh_pending *pending = &ec->pending;
+	struct ssh_rqst_class *class;
+	struct ssh_request *rq;
+	bool waiting = false;
+	bool aged;
+	ktime_t now;
+	u64 wait;
+	int n = 0;
+	int i;
+
+	// re-transmissions first
+	for (i = 0; i < SSH_PENDING_MAX; i++) {
+		rq = pending->slot[i];
+		if (!rq || rq->state != SSH_RQST_PENDING_ACK) {
+			continue;
+		}
+
+		if (!rq->resend) {
+			waiting = true;
+			continue;
+		}
+
+		/*
+		 * Re-transmissions are paced by the adaptive RTO, which may be
+		 * far below the time the EC needs to recover from a stall. Only
+		 * give up once the ACK budget has passed as well.
+		 */
+		if (rq->tries >= SSH_NUM_RETRY
+		    && time_after_eq(jiffies, rq->first_sent + SSH_ACK_BUDGET)) {
+			ssh_pending_remove(ec, rq);
+			list_add_tail(&rq->node, failed);
+			continue;
+		}
+
+		burst[n++] = rq;
+	}
+
+	if (waiting || n) {
+		return n;
+	}
+
+	now = ktime_get();
+
+	while (n < SSH_PENDING_MAX) {
+		rq = ssh_pending_next(pending, now, &aged);
+		if (!rq || !ssh_pending_insert(ec, rq)) {
+			break;
+		}
+
+		list_del(&rq->node);
+
+		wait = ktime_to_ns(ktime_sub(now, rq->queued));
+
+		class = &pending->class[rq->rqst.prio];
+		class->depth -= 1;
+		class->dispatched += 1;
+		class->aged += aged;
+		class->wait_ns += wait;
+		class->wait_max_ns = max(class->wait_max_ns, wait);
+
+		rq->seq = ec->counter.seq;
+		rq->state = SSH_RQST_PENDING_ACK;
+		ec->counter.seq += 1;
+
+		burst[n++] = rq;
+	}
+
+	return n;
+}
+
+/*
+ * Finish the buffer that has just been written (or failed to): arm the ACK
+ * timeout of the requests in it, or fail them.
+ */
+static void ssh_tx_finish(struct sam_ssh_ec *ec, int status)
+{
+	struct ssh_writer *writer = &ec->writer;
+	struct ssh_pending *pending = &ec->pending;
+	struct device *dev = &ec->serdev->dev;
+	struct ssh_request *rq;
+	unsigned long flags;
+	int i;
+
+	if (status && writer->n_ack) {
+		dev_err(dev, SSH_RQST_TAG "failed to send ACK: %d\n", status);
+	}
+
+	for (i = 0; i < writer->n_burst; i++) {
+		rq = writer->burst[i];
+
+		spin_lock_irqsave(&pending->lock, flags);
+
+		if (rq->state != SSH_RQST_PENDING_ACK) {
+			// already completed or acknowledged
+			spin_unlock_irqrestore(&pending->lock, flags);
+
+		} else if (status) {
+			ssh_pending_remove(ec, rq);
+			spin_unlock_irqrestore(&pending->lock, flags);
+
+			dev_err(dev, SSH_RQST_TAG "failed to send command: %d\n", status);
+			ssh_request_complete(rq, status);
+
+		} else {
+			rq->expires = jiffies + ssh_rto_ack(ec);
+			ssh_reaper_arm(ec, rq->expires);
+			spin_unlock_irqrestore(&pending->lock, flags);
+		}
+
+		ssh_request_put(rq);
+	}
+
+	writer->n_burst = 0;
+	writer->n_ack = 0;
+	ssh_writer_reset(writer);
+}
+
+/*
+ * Fill the buffer with all queued ACKs and the next command burst. Returns
+ * false if there is nothing to send.
+ */
+static bool ssh_tx_fill(struct sam_ssh_ec *ec)
+{
+	struct ssh_writer *writer = &ec->writer;
+	struct ssh_pending *pending = &ec->pending;
+	struct device *dev = &ec->serdev->dev;
+	struct ssh_request *rq, *tmp;
+	unsigned long flags;
+	bool progress;
+	int i;
+	u8 seq;
+
+	for (;;) {
+		LIST_HEAD(failed);
+
+		ssh_writer_reset(writer);
+
+		// ACKs first, the EC re-transmits if they're late
+		for (writer->n_ack = 0; kfifo_get(&writer->ack, &seq); writer->n_ack++) {
+			ssh_write_msg_ack(ec, seq);
+		}
+
+		spin_lock_irqsave(&pending->lock, flags);
+
+		writer->n_burst = ssh_tx_collect(ec, writer->burst, &failed);
+
+		for (i = 0; i < writer->n_burst; i++) {
+			rq = writer->burst[i];
+
+			if (!rq->tries) {
+				rq->first_sent = jiffies;
+			}
+
+			rq->resend = false;
+			rq->tries += 1;
+
+			// don't let the reaper interfere while we're writing
+			rq->expires = jiffies + SSH_WRITE_TIMEOUT + SSH_READ_TIMEOUT;
+			rq->sent = ktime_get();
+
+			ssh_write_msg_cmd(ec, rq);
+			refcount_inc(&rq->refcount);
+		}
+
+		spin_unlock_irqrestore(&pending->lock, flags);
+
+		progress = !list_empty(&failed);
+		list_for_each_entry_safe(rq, tmp, &failed, node) {
+			list_del(&rq->node);
+
+			dev_err(dev, SSH_RQST_TAG "communication failed %d times, giving up\n",
+				rq->tries);
+
+			ssh_request_complete(rq, -EIO);
+		}
+
+		if (writer->n_burst || writer->n_ack) {
+			return true;
+		}
+
+		// completing failed requests may have unblocked the queue
+		if (!progress) {
+			return false;
+		}
+	}
+}
+
+static void ssh_tx_run(struct sam_ssh_ec *ec)
+{
+	struct ssh_writer *writer = &ec->writer;
+	int status;
+
+	// make sure we load a fresh ec state
+	smp_mb();
+
+	// ACKs left at removal are silently dropped, no requests are pending
+	if (ec->state == SSH_EC_UNINITIALIZED) {
+		return;
+	}
+
+	for (;;) {
+		if (!ssh_writer_busy(writer)) {
+			if (!ssh_tx_fill(ec)) {
+				break;
+			}
+
+			ssh_writer_start(ec);
+		}
+
+		status = ssh_writer_push(ec);
+		if (status == -EAGAIN) {
+			if (time_before(jiffies, writer->deadline)) {
+				// continue on write_wakeup, or time out
+				mod_delayed_work(ec->pending.queue_tx, &writer->timeout,
+						 writer->deadline - jiffies);
+				break;
+			}
+
+			// don't leave a partial message in the UART buffer
+			serdev_device_write_flush(ec->serdev);
+			status = -ETIMEDOUT;
+		}
+
+		cancel_delayed_work(&writer->timeout);
+		ssh_tx_finish(ec, status);
+	}
+}
+
+static void ssh_tx_work_handler(struct work_struct *work)
+{
+	ssh_tx_run(container_of(work, struct sam_ssh_ec, writer.work));
+}
+
+static void ssh_tx_timeout_handler(struct work_struct *work)
+{
+	ssh_tx_run(container_of(to_delayed_work(work), struct sam_ssh_ec, writer.timeout));
+}
+
+struct ssh_deadline_scan {
+	unsigned long now;
+	unsigned long next;	// earliest deadline not yet expired
+	bool found;
+};
+
+static bool ssh_request_match_expired(const struct ssh_request *rq, void *arg)
+{
+	struct ssh_deadline_scan *scan = arg;
+
+	if (!rq->rqst.timeout) {
+		return false;
+	}
+
+	if (time_after_eq(scan->now, rq->deadline)) {
+		return true;
+	}
+
+	if (!scan->found || time_before(rq->deadline, scan->next)) {
+		scan->next = rq->deadline;
+		scan->found = true;
+	}
+
+	return false;
+}
+
+/*
+ * Fail requests past their deadline and time out pending requests. Requests
+ * waiting for their ACK are re-sent, the transmitter gives up on them after
+ * SSH_NUM_RETRY tries and SSH_ACK_BUDGET since the first transmission.
+ */
+static void ssh_reaper_work_handler(struct work_struct *work)
+{
+	struct sam_ssh_ec *ec = container_of(work, struct sam_ssh_ec, pending.reaper.work);
+	struct ssh_pending *pending = &ec->pending;
+	struct device *dev = &ec->serdev->dev;
+	struct ssh_request *rq, *n;
+	struct ssh_deadline_scan scan;
+	unsigned long now = jiffies;
+	unsigned long next = 0;
+	unsigned long flags;
+	bool resend = false;
+	bool rearm = false;
+	LIST_HEAD(timed_out);
+	LIST_HEAD(expired);
+	int i;
+
+	spin_lock_irqsave(&pending->lock, flags);
+	pending->reaper_armed = false;
+
+	// requests past their deadline, wherever they are
+	scan.now = now;
+	scan.found = false;
+	ssh_pending_drop_matching(ec, ssh_request_match_expired, &scan, &expired);
+
+	if (scan.found) {
+		next = scan.next;
+		rearm = true;
+	}
+
+	for (i = 0; i < SSH_PENDING_MAX; i++) {
+		rq = pending->slot[i];
+		// the transmitter takes care of re-transmissions
+		if (!rq || (rq->resend && rq->state == SSH_RQST_PENDING_ACK)) {
+			continue;
+		}
+
+		if (time_before(now, rq->expires)) {
+			if (!rearm || time_before(rq->expires, next)) {
+				next = rq->expires;
+				rearm = true;
+			}
+			continue;
+		}
+
+		// ACK timed out: re-send command, giving up is handled on transmit
+		if (rq->state == SSH_RQST_PENDING_ACK) {
+			rq->resend = true;
+			resend = true;
+			continue;
+		}
+
+		// response timed out
+		ssh_pending_remove(ec, rq);
+		list_add_tail(&rq->node, &timed_out);
+	}
+
+	if (resend && ec->rtt.backoff < SSH_RTO_MAX_BACKOFF) {
+		ec->rtt.backoff += 1;
+	}
+
+	if (rearm) {
+		ssh_reaper_arm(ec, next);
+	}
+
+	spin_unlock_irqrestore(&pending->lock, flags);
+
+	if (resend) {
+		queue_work(pending->queue_tx, &ec->writer.work);
+	}
+
+	list_for_each_entry_safe(rq, n, &timed_out, node) {
+		dev_err(dev, SSH_RQST_TAG "communication timed out\n");
+		ssh_request_complete(rq, -EIO);
+	}
+
+	list_for_each_entry_safe(rq, n, &expired, node) {
+		dev_dbg(dev, SSH_RQST_TAG "deadline expired\n");
+		ssh_request_complete(rq, -ETIMEDOUT);
+	}
+}
+
+
+static struct ssh_request *ssh_request_alloc(struct sam_ssh_ec *ec,
+					     const struct surface_sam_ssh_rqst *rqst,
+					     struct surface_sam_ssh_buf *result,
+					     surface_sam_ssh_rqst_complete_fn complete,
+					     void *complete_data)
+{
+	struct device *dev = &ec->serdev->dev;
+	struct ssh_request *rq;
+
+	if (rqst->cdl > SURFACE_SAM_SSH_MAX_RQST_PAYLOAD) {
+		dev_err(dev, SSH_RQST_TAG "request payload too large\n");
+		return ERR_PTR(-EINVAL);
+	}
+
+	if (rqst->prio >= SURFACE_SAM_SSH_RQST_PRIO_NUM) {
+		dev_err(dev, SSH_RQST_TAG "invalid request priority class\n");
+		return ERR_PTR(-EINVAL);
+	}
+
+	rq = kzalloc(sizeof(struct ssh_request) + rqst->cdl, GFP_KERNEL);
+	if (!rq) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	refcount_set(&rq->refcount, 1);
+	rq->ec            = ec;
+	rq->state         = SSH_RQST_QUEUED;
+	rq->expect_rsp    = rqst->snc;
+	rq->result        = result;
+	rq->complete      = complete;
+	rq->complete_data = complete_data;
+	rq->deadline      = jiffies + msecs_to_jiffies(rqst->timeout);
+	INIT_LIST_HEAD(&rq->followers);
+
+	rq->rqst     = *rqst;
+	rq->rqst.pld = rq->pld;
+	memcpy(rq->pld, rqst->pld, rqst->cdl);
+
+	return rq;
+}
+
+/*
+ * Submit a batch of requests. Either all or none of the requests are
+ * submitted. Requests are queued in one go, so the transmitter can send
+ * them with a single write if they share the same priority class.
+ */
+static int ssh_rqst_submit_batch(struct sam_ssh_ec *ec,
+				 const struct surface_sam_ssh_rqst *rqsts,
+				 struct surface_sam_ssh_buf *results, int count,
+				 surface_sam_ssh_rqst_complete_fn complete,
+				 void *complete_data)
+{
+	struct ssh_request *rq, *n, *leader;
+	struct ssh_rqst_class *class;
+	unsigned long flags;
+	LIST_HEAD(batch);
+	LIST_HEAD(cached);
+	ktime_t now;
+	int status;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		rq = ssh_request_alloc(ec, &rqsts[i], results ? &results[i] : NULL,
+				       complete, complete_data);
+		if (IS_ERR(rq)) {
+			status = PTR_ERR(rq);
+			goto err_alloc;
+		}
+
+		list_add_tail(&rq->node, &batch);
+	}
+
+	list_for_each_entry_safe(rq, n, &batch, node) {
+		if (!(rq->rqst.flags & SURFACE_SAM_SSH_RQST_IDEMPOTENT)) {
+			ssh_cache_invalidate(&ec->cache, rq->rqst.tc);
+		} else if (!ssh_request_cacheable(rq)) {
+			rq->cache_gen = ssh_cache_generation(&ec->cache, rq->rqst.tc);
+		} else if (ssh_cache_lookup(&ec->cache, rq)) {
+			list_move_tail(&rq->node, &cached);
+		}
+	}
+
+	now = ktime_get();
+
+	spin_lock_irqsave(&ec->pending.lock, flags);
+	list_for_each_entry_safe(rq, n, &batch, node) {
+		rq->queued = now;
+
+		if (rq->rqst.timeout) {
+			ssh_reaper_arm(ec, rq->deadline);
+		}
+
+		leader = ssh_pending_leader(&ec->pending, rq);
+		if (leader) {
+			list_del(&rq->node);
+			ssh_pending_follow(&ec->pending, leader, rq);
+			continue;
+		}
+
+		list_move_tail(&rq->node, &ec->pending.queue[rq->rqst.prio]);
+
+		class = &ec->pending.class[rq->rqst.prio];
+		class->depth += 1;
+		class->depth_max = max(class->depth_max, class->depth);
+	}
+	spin_unlock_irqrestore(&ec->pending.lock, flags);
+
+	// responses have already been copied on lookup
+	list_for_each_entry_safe(rq, n, &cached, node) {
+		list_del(&rq->node);
+		ssh_request_finish(rq, 0, NULL, 0);
+	}
+
+	queue_work(ec->pending.queue_tx, &ec->writer.work);
+	return 0;
+
+err_alloc:
+	list_for_each_entry_safe(rq, n, &batch, node) {
+		kfree(rq);
+	}
+	return status;
+}
+
+inline static int ssh_rqst_submit(struct sam_ssh_ec *ec,
+				  const struct surface_sam_ssh_rqst *rqst,
+				  struct surface_sam_ssh_buf *result,
+				  surface_sam_ssh_rqst_complete_fn complete,
+				  void *complete_data)
+{
+	return ssh_rqst_submit_batch(ec, rqst, result, 1, complete, complete_data);
+}
+
+
+struct ssh_rqst_sync {
+	struct completion done;
+	atomic_t remaining;
+	int status;		// status of first failed request
+};
+
+struct ssh_rqst_cancel_match {
+	surface_sam_ssh_rqst_complete_fn complete;
+	void *data;
+};
+
+static bool ssh_request_match_caller(const struct ssh_request *rq, void *arg)
+{
+	struct ssh_rqst_cancel_match *m = arg;
+
+	return rq->complete == m->complete && rq->complete_data == m->data;
+}
+
+static int ssh_rqst_cancel(struct sam_ssh_ec *ec, surface_sam_ssh_rqst_complete_fn complete,
+			   void *data)
+{
+	struct ssh_rqst_cancel_match m = { complete, data };
+	struct ssh_request *rq, *n;
+	unsigned long flags;
+	LIST_HEAD(dropped);
+	int count;
+
+	spin_lock_irqsave(&ec->pending.lock, flags);
+	count = ssh_pending_drop_matching(ec, ssh_request_match_caller, &m, &dropped);
+	spin_unlock_irqrestore(&ec->pending.lock, flags);
+
+	list_for_each_entry_safe(rq, n, &dropped, node) {
+		ssh_request_complete(rq, -ECANCELED);
+	}
+
+	return count;
+}
+
+
+static void ssh_rqst_sync_complete(int status, struct surface_sam_ssh_buf *result, void *data)
+{
+	struct ssh_rqst_sync *sync = data;
+
+	if (status) {
+		cmpxchg(&sync->status, 0, status);
+	}
+
+	if (atomic_dec_and_test(&sync->remaining)) {
+		complete(&sync->done);
+	}
+}
+
+static int surface_sam_ssh_rqst_batch_unlocked(struct sam_ssh_ec *ec,
+					       const struct surface_sam_ssh_rqst *rqsts,
+					       struct surface_sam_ssh_buf *results,
+					       int count)
+{
+	struct ssh_rqst_sync sync;
+	bool interruptible = false;
+	int status;
+	int i;
+
+	init_completion(&sync.done);
+	atomic_set(&sync.remaining, count);
+	sync.status = 0;
+
+	for (i = 0; i < count; i++) {
+		if (rqsts[i].flags & SURFACE_SAM_SSH_RQST_INTERRUPTIBLE) {
+			interruptible = true;
+		}
+	}
+
+	status = ssh_rqst_submit_batch(ec, rqsts, results, count,
+				       ssh_rqst_sync_complete, &sync);
+	if (status) {
+		return status;
+	}
+
+	if (!interruptible) {
+		wait_for_completion(&sync.done);
+		return sync.status;
+	}
+
+	status = wait_for_completion_interruptible(&sync.done);
+	if (status) {
+		/*
+		 * The completion is on our stack, wait for requests that are
+		 * just being completed.
+		 */
+		ssh_rqst_cancel(ec, ssh_rqst_sync_complete, &sync);
+		wait_for_completion(&sync.done);
+		return status;
+	}
+
+	return sync.status;
+}
+
+static int surface_sam_ssh_rqst_unlocked(struct sam_ssh_ec *ec,
+					 const struct surface_sam_ssh_rqst *rqst,
+					 struct surface_sam_ssh_buf *result)
+{
+	return surface_sam_ssh_rqst_batch_unlocked(ec, rqst, result, 1);
+}
+
+int surface_sam_ssh_rqst_async(const struct surface_sam_ssh_rqst *rqst,
+			       struct surface_sam_ssh_buf *result,
+			       surface_sam_ssh_rqst_complete_fn complete,
+			       void *data)
+{
+	struct sam_ssh_ec *ec;
+	int status;
+
+	ec = surface_sam_ssh_acquire_shared_init();
+	if (!ec) {
+		printk(KERN_WARNING SSH_RQST_TAG_FULL "embedded controller is uninitialized\n");
+		return -ENXIO;
+	}
+
+	if (ec->state == SSH_EC_SUSPENDED) {
+		dev_warn(&ec->serdev->dev, SSH_RQST_TAG "embedded controller is suspended\n");
+
+		surface_sam_ssh_release_shared(ec);
+		return -EPERM;
+	}
+
+	status = ssh_rqst_submit(ec, rqst, result, complete, data);
+
+	surface_sam_ssh_release_shared(ec);
+	return status;
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_rqst_async);
+
+int surface_sam_ssh_rqst(const struct surface_sam_ssh_rqst *rqst, struct surface_sam_ssh_buf *result)
+{
+	struct sam_ssh_ec *ec;
+	int status;
+
+	ec = surface_sam_ssh_acquire_shared_init();
+	if (!ec) {
+		printk(KERN_WARNING SSH_RQST_TAG_FULL "embedded controller is uninitialized\n");
+		return -ENXIO;
+	}
+
+	if (ec->state == SSH_EC_SUSPENDED) {
+		dev_warn(&ec->serdev->dev, SSH_RQST_TAG "embedded controller is suspended\n");
+
+		surface_sam_ssh_release_shared(ec);
+		return -EPERM;
+	}
+
+	status = surface_sam_ssh_rqst_unlocked(ec, rqst, result);
+
+	surface_sam_ssh_release_shared(ec);
+	return status;
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_rqst);
+
+int surface_sam_ssh_rqst_batch(const struct surface_sam_ssh_rqst *rqsts,
+			       struct surface_sam_ssh_buf *results, int count)
+{
+	struct sam_ssh_ec *ec;
+	int status;
+
+	if (count <= 0) {
+		return -EINVAL;
+	}
+
+	ec = surface_sam_ssh_acquire_shared_init();
+	if (!ec) {
+		printk(KERN_WARNING SSH_RQST_TAG_FULL "embedded controller is uninitialized\n");
+		return -ENXIO;
+	}
+
+	if (ec->state == SSH_EC_SUSPENDED) {
+		dev_warn(&ec->serdev->dev, SSH_RQST_TAG "embedded controller is suspended\n");
+
+		surface_sam_ssh_release_shared(ec);
+		return -EPERM;
+	}
+
+	status = surface_sam_ssh_rqst_batch_unlocked(ec, rqsts, results, count);
+
+	surface_sam_ssh_release_shared(ec);
+	return status;
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_rqst_batch);
+
+int surface_sam_ssh_rqst_cancel(surface_sam_ssh_rqst_complete_fn complete, void *data)
+{
+	struct sam_ssh_ec *ec;
+	int status;
+
+	ec = surface_sam_ssh_acquire_shared_init();
+	if (!ec) {
+		return -ENXIO;
+	}
+
+	status = ssh_rqst_cancel(ec, complete, data);
+
+	surface_sam_ssh_release_shared(ec);
+	return status;
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_rqst_cancel);
+
+
+static int surface_sam_ssh_ec_resume(struct sam_ssh_ec *ec)
+{
+	u8 buf[1] = { 0x00 };
+
+	struct surface_sam_ssh_rqst rqst = {
+		.tc  = 0x01,
+		.iid = 0x00,
+		.cid = 0x16,
+		.snc = 0x01,
+		.cdl = 0x00,
+		.pld = NULL,
+	};
+
+	struct surface_sam_ssh_buf result = {
+		result.cap = ARRAY_SIZE(buf),
+		result.len = 0,
+		result.data = buf,
+	};
+
+	int status = surface_sam_ssh_rqst_unlocked(ec, &rqst, &result);
+	if (status) {
+		return status;
+	}
+
+	if (buf[0] != 0x00) {
+		dev_warn(&ec->serdev->dev,
+		         "unexpected result while trying to resume EC: 0x%02x\n",
+			 buf[0]);
+	}
+
+	return 0;
+}
+
+static int surface_sam_ssh_ec_suspend(struct sam_ssh_ec *ec)
+{
+	u8 buf[1] = { 0x00 };
+
+	struct surface_sam_ssh_rqst rqst = {
+		.tc  = 0x01,
+		.iid = 0x00,
+		.cid = 0x15,
+		.snc = 0x01,
+		.cdl = 0x00,
+		.pld = NULL,
+	};
+
+	struct surface_sam_ssh_buf result = {
+		result.cap = ARRAY_SIZE(buf),
+		result.len = 0,
+		result.data = buf,
+	};
+
+	int status = surface_sam_ssh_rqst_unlocked(ec, &rqst, &result);
+	if (status) {
+		return status;
+	}
+
+	if (buf[0] != 0x00) {
+		dev_warn(&ec->serdev->dev,
+		         "unexpected result while trying to suspend EC: 0x%02x\n",
+			 buf[0]);
+	}
+
+	return 0;
+}
+
+
+inline static bool ssh_is_valid_syn(const u8 *ptr)
+{
+	return ptr[0] == 0xaa && ptr[1] == 0x55;
+}
+
+inline static bool ssh_is_valid_ter(const u8 *ptr)
+{
+	return ptr[0] == 0xff && ptr[1] == 0xff;
+}
+
+inline static bool ssh_crc_matches(u16 crc, const u8 *ptr)
+{
+	return (ptr[0] == (crc & 0xff)) && (ptr[1] == (crc >> 8));
+}
+
+inline static bool ssh_is_valid_crc(const u8 *begin, const u8 *end)
+{
+	return ssh_crc_matches(ssh_crc(begin, end - begin), end);
+}
+
+
+static void ssh_event_pool_init(struct ssh_event_pool *pool,
+				struct ssh_event_work *items)
+{
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&pool->lock, flags);
+
+	pool->items = items;
+	pool->used = 0;
+	pool->high = 0;
+	pool->exhausted = 0;
+
+	INIT_LIST_HEAD(&pool->free);
+	for (i = 0; i < SSH_EVENT_POOL_SIZE; i++) {
+		list_add_tail(&items[i].node, &pool->free);
+	}
+
+	spin_unlock_irqrestore(&pool->lock, flags);
+}
+
+static void ssh_event_pool_free(struct ssh_event_pool *pool)
+{
+	struct ssh_event_work *items;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	WARN_ON(pool->used);
+
+	items = pool->items;
+	pool->items = NULL;
+	INIT_LIST_HEAD(&pool->free);
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	kfree(items);
+}
+
+static struct ssh_event_work *ssh_event_work_get(struct ssh_event_pool *pool)
+{
+	struct ssh_event_work *work;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pool->lock, flags);
+
+	work = list_first_entry_or_null(&pool->free, struct ssh_event_work, node);
+	if (work) {
+		list_del(&work->node);
+
+		pool->used += 1;
+		if (pool->used > pool->high) {
+			pool->high = pool->used;
+		}
+	} else {
+		pool->exhausted += 1;
+	}
+
+	spin_unlock_irqrestore(&pool->lock, flags);
+	return work;
+}
+
+static void ssh_event_work_put(struct ssh_event_pool *pool, struct ssh_event_work *work)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	list_add(&work->node, &pool->free);
+	pool->used -= 1;
+	spin_unlock_irqrestore(&pool->lock, flags);
+}
+
+static void ssh_event_work_release(struct ssh_event_work *work)
+{
+	struct surface_sam_ssh_event_subscriber *sub = work->sub;
+	struct sam_ssh_ec *ec = work->ec;
+
+	ssh_event_work_put(&ec->events.pool, work);
+
+	// sub may be gone once pending drops to zero, don't touch it after
+	if (atomic_dec_and_test(&sub->pending)) {
+		wake_up_all(&ec->events.waitq);
+	}
+}
+
+static void ssh_event_dispatch(struct ssh_event_work *work)
+{
+	struct surface_sam_ssh_event_subscriber *sub = work->sub;
+	struct sam_ssh_ec *ec = work->ec;
+	struct device *dev = &ec->serdev->dev;
+	struct ssh_event_source *src;
+	unsigned long flags;
+	ktime_t start, end;
+	u64 latency, runtime;
+	int status;
+
+	src = &ec->events.source[work->event.rqid - 1];
+
+	/*
+	 * Unsubscribing waits for all pending events of the subscriber. Thus
+	 * it is guaranteed to be valid at least until the work is released.
+	 * Events not started before unsubscribing began are dropped, this
+	 * covers the ones already queued for the immediate-event thread.
+	 */
+	if (READ_ONCE(sub->removed)) {
+		ssh_event_work_release(work);
+		return;
+	}
+
+	start = ktime_get();
+	status = sub->handler(&work->event, sub->data);
+	end = ktime_get();
+
+	if (status) {
+		dev_err(dev, SSH_EVENT_TAG "error handling event: %d\n", status);
+	}
+
+	latency = ktime_to_ns(ktime_sub(start, work->event.timestamp));
+	runtime = ktime_to_ns(ktime_sub(end, start));
+
+	spin_lock_irqsave(&src->lock, flags);
+	src->handled += 1;
+	src->runtime_ns += runtime;
+	src->runtime_max_ns = max(src->runtime_max_ns, runtime);
+	src->latency_ns += latency;
+	src->latency_max_ns = max(src->latency_max_ns, latency);
+	spin_unlock_irqrestore(&src->lock, flags);
+
+	ssh_event_work_release(work);
+}
+
+static void ssh_event_source_init(struct ssh_event_source *src, work_func_t fn)
+{
+	spin_lock_init(&src->lock);
+	INIT_LIST_HEAD(&src->queue);
+	INIT_LIST_HEAD(&src->delayed);
+	INIT_WORK(&src->work, fn);
+
+	src->backlog = 0;
+	src->depth = 0;
+	src->depth_max = 0;
+	src->handled = 0;
+	src->runtime_ns = 0;
+	src->runtime_max_ns = 0;
+	src->latency_ns = 0;
+	src->latency_max_ns = 0;
+	src->coalesced = 0;
+	src->dropped = 0;
+}
+
+static void ssh_event_source_work_handler(struct work_struct *_work)
+{
+	struct ssh_event_source *src;
+	struct ssh_event_work *work;
+	unsigned long flags;
+
+	src = container_of(_work, struct ssh_event_source, work);
+
+	for (;;) {
+		spin_lock_irqsave(&src->lock, flags);
+		work = list_first_entry_or_null(&src->queue, struct ssh_event_work, node);
+		if (work) {
+			list_del(&work->node);
+			src->backlog -= 1;
+		}
+		spin_unlock_irqrestore(&src->lock, flags);
+
+		if (!work) {
+			break;
+		}
+
+		ssh_event_dispatch(work);
+
+		spin_lock_irqsave(&src->lock, flags);
+		src->depth -= 1;
+		spin_unlock_irqrestore(&src->lock, flags);
+	}
+}
+
+static void ssh_event_source_queue(struct sam_ssh_ec *ec, struct ssh_event_work *work)
+{
+	struct ssh_event_source *src = &ec->events.source[work->event.rqid - 1];
+	unsigned long flags;
+
+	spin_lock_irqsave(&src->lock, flags);
+	list_add_tail(&work->node, &src->queue);
+
+	src->depth += 1;
+	if (src->depth > src->depth_max) {
+		src->depth_max = src->depth;
+	}
+	spin_unlock_irqrestore(&src->lock, flags);
+
+	queue_work(ec->events.queue_evt, &src->work);
+}
+
+static void ssh_event_delay_work_handler(struct work_struct *_work)
+{
+	struct delayed_work *dwork = to_delayed_work(_work);
+	struct ssh_event_source *src;
+	struct ssh_event_work *work;
+	unsigned long flags;
+
+	work = container_of(dwork, struct ssh_event_work, work_evt);
+	src = &work->ec->events.source[work->event.rqid - 1];
+
+	// window closed, later events can't be coalesced into this one any more
+	spin_lock_irqsave(&src->lock, flags);
+	list_del(&work->node);
+	spin_unlock_irqrestore(&src->lock, flags);
+
+	ssh_event_source_queue(work->ec, work);
+}
+
+inline static bool ssh_event_same_key(const struct ssh_event_work *a,
+				      const struct ssh_event_work *b)
+{
+	return a->sub == b->sub && a->event.tc == b->event.tc
+	       && a->event.iid == b->event.iid && a->event.cid == b->event.cid;
+}
+
+/*
+ * Queue the event once the given delay has expired. If coalescing is
+ * requested and an event with the same key is already waiting, update that
+ * event instead and return the new one to the pool.
+ */
+static void ssh_event_source_delay(struct sam_ssh_ec *ec, struct ssh_event_work *work,
+				   unsigned long delay, bool coalesce)
+{
+	struct ssh_event_source *src = &ec->events.source[work->event.rqid - 1];
+	struct ssh_event_work *p;
+	unsigned long flags;
+
+	spin_lock_irqsave(&src->lock, flags);
+
+	if (coalesce) {
+		list_for_each_entry(p, &src->delayed, node) {
+			if (!ssh_event_same_key(p, work)) {
+				continue;
+			}
+
+			memcpy(p->pld, work->pld, work->event.len);
+			p->event.len = work->event.len;
+			src->coalesced += 1;
+			src->backlog -= 1;
+
+			spin_unlock_irqrestore(&src->lock, flags);
+			ssh_event_work_release(work);
+			return;
+		}
+	}
+
+	list_add_tail(&work->node, &src->delayed);
+
+	INIT_DELAYED_WORK(&work->work_evt, ssh_event_delay_work_handler);
+	queue_delayed_work(ec->events.queue_evt, &work->work_evt, delay);
+
+	spin_unlock_irqrestore(&src->lock, flags);
+}
+
+/*
+ * Drop all events of the subscriber that are still delayed or queued. Events
+ * that are already running are left alone and accounted for by the
+ * subscriber's pending count. Events queued for the immediate-event thread
+ * are dropped on dispatch (see ssh_event_dispatch).
+ */
+static void ssh_event_cancel(struct sam_ssh_ec *ec,
+			     struct surface_sam_ssh_event_subscriber *sub)
+{
+	struct ssh_event_source *src = &ec->events.source[sub->rqid - 1];
+	struct ssh_event_work *work, *tmp;
+	unsigned long flags;
+	LIST_HEAD(dropped);
+
+	spin_lock_irqsave(&src->lock, flags);
+
+	/*
+	 * If cancelling fails, the delay has expired and the work is waiting
+	 * for this lock to move the event to the source queue.
+	 */
+	list_for_each_entry_safe(work, tmp, &src->delayed, node) {
+		if (work->sub == sub && cancel_delayed_work(&work->work_evt)) {
+			list_move_tail(&work->node, &dropped);
+			src->backlog -= 1;
+		}
+	}
+
+	list_for_each_entry_safe(work, tmp, &src->queue, node) {
+		if (work->sub == sub) {
+			list_move_tail(&work->node, &dropped);
+			src->backlog -= 1;
+			src->depth -= 1;
+		}
+	}
+
+	spin_unlock_irqrestore(&src->lock, flags);
+
+	list_for_each_entry_safe(work, tmp, &dropped, node) {
+		list_del(&work->node);
+		ssh_event_work_release(work);
+	}
+}
+
+static int param_event_backlog = SSH_EVENT_BACKLOG_DEFAULT;
+
+static int param_event_backlog_set(const char *val, const struct kernel_param *kp)
+{
+	int backlog;
+	int status;
+
+	status = kstrtoint(val, 0, &backlog);
+	if (status) {
+		return status;
+	}
+
+	if (backlog < 1 || backlog > SSH_EVENT_POOL_SIZE) {
+		return -EINVAL;
+	}
+
+	return param_set_int(val, kp);
+}
+
+static const struct kernel_param_ops param_event_backlog_ops = {
+	.set = param_event_backlog_set,
+	.get = param_get_int,
+};
+
+module_param_cb(event_backlog, &param_event_backlog_ops, &param_event_backlog, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(event_backlog, "Maximum number of waiting events per event source");
+
+/*
+ * Find the oldest waiting event of the subscriber and detach it from the
+ * source. Delayed events whose timer has already fired are skipped.
+ */
+static struct ssh_event_work *ssh_event_source_steal_oldest(struct ssh_event_source *src,
+						     struct surface_sam_ssh_event_subscriber *sub)
+{
+	struct ssh_event_work *p;
+
+	list_for_each_entry(p, &src->queue, node) {
+		if (p->sub == sub) {
+			list_del(&p->node);
+			src->depth -= 1;
+			return p;
+		}
+	}
+
+	list_for_each_entry(p, &src->delayed, node) {
+		if (p->sub == sub && cancel_delayed_work(&p->work_evt)) {
+			list_del(&p->node);
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Find the newest waiting event with the same key as the given one and
+ * replace its data.
+ */
+static bool ssh_event_source_merge(struct ssh_event_source *src,
+				   const struct ssh_event_work *work)
+{
+	struct ssh_event_work *p;
+
+	list_for_each_entry_reverse(p, &src->queue, node) {
+		if (ssh_event_same_key(p, work)) {
+			goto found;
+		}
+	}
+
+	list_for_each_entry_reverse(p, &src->delayed, node) {
+		if (ssh_event_same_key(p, work)) {
+			goto found;
+		}
+	}
+
+	return false;
+
+found:
+	memcpy(p->pld, work->pld, work->event.len);
+	p->event.len = work->event.len;
+	return true;
+}
+
+/*
+ * Account the new event in the backlog of its source. If the backlog is
+ * full, apply the overflow policy of the subscriber. Returns false if the
+ * event has been consumed (merged or dropped) and must not be queued.
+ */
+static bool ssh_event_source_admit(struct sam_ssh_ec *ec, struct ssh_event_work *work)
+{
+	struct ssh_event_source *src = &ec->events.source[work->event.rqid - 1];
+	struct ssh_event_work *victim = NULL;
+	struct ssh_event_work *release = NULL;
+	unsigned long flags;
+	bool admit = true;
+
+	spin_lock_irqsave(&src->lock, flags);
+
+	if (src->backlog < READ_ONCE(param_event_backlog)) {
+		src->backlog += 1;
+		goto out;
+	}
+
+	switch (work->sub->overflow) {
+	case SURFACE_SAM_SSH_EVENT_OVERFLOW_DROP_OLDEST:
+		victim = ssh_event_source_steal_oldest(src, work->sub);
+		break;
+
+	case SURFACE_SAM_SSH_EVENT_OVERFLOW_COALESCE:
+		if (ssh_event_source_merge(src, work)) {
+			src->coalesced += 1;
+			release = work;
+			admit = false;
+			goto out;
+		}
+		break;
+
+	case SURFACE_SAM_SSH_EVENT_OVERFLOW_DROP_NEWEST:
+	default:
+		break;
+	}
+
+	src->dropped += 1;
+
+	// the new event takes the place of the victim
+	if (victim) {
+		release = victim;
+	} else {
+		release = work;
+		admit = false;
+	}
+
+out:
+	spin_unlock_irqrestore(&src->lock, flags);
+
+	if (release) {
+		ssh_event_work_release(release);
+	}
+
+	return admit;
+}
+
+static int param_event_rt_prio = SSH_EVENT_RT_PRIO_DEFAULT;
+
+static int param_event_rt_prio_set(const char *val, const struct kernel_param *kp)
+{
+	int prio;
+	int status;
+
+	status = kstrtoint(val, 0, &prio);
+	if (status) {
+		return status;
+	}
+
+	if (prio < 0 || prio >= MAX_RT_PRIO) {
+		return -EINVAL;
+	}
+
+	return param_set_int(val, kp);
+}
+
+static const struct kernel_param_ops param_event_rt_prio_ops = {
+	.set = param_event_rt_prio_set,
+	.get = param_get_int,
+};
+
+module_param_cb(event_rt_prio, &param_event_rt_prio_ops, &param_event_rt_prio, S_IRUGO);
+MODULE_PARM_DESC(event_rt_prio, "SCHED_FIFO priority of the immediate-event thread (0: SCHED_NORMAL)");
+
+static int ssh_event_rt_thread(void *data)
+{
+	struct ssh_event_rt *rt = data;
+	struct ssh_event_work *work;
+
+	for (;;) {
+		wait_event_interruptible(rt->waitq, !kfifo_is_empty(&rt->queue)
+					 || kthread_should_stop());
+
+		while (kfifo_get(&rt->queue, &work)) {
+			ssh_event_dispatch(work);
+
+			// order handler completion before done
+			smp_store_release(&rt->done, rt->done + 1);
+			wake_up(&rt->idle);
+		}
+
+		// the receiver is closed before we get stopped, nothing is left
+		if (kthread_should_stop()) {
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int ssh_event_rt_start(struct ssh_event_rt *rt)
+{
+	struct sched_param param = { .sched_priority = param_event_rt_prio };
+	struct task_struct *thread;
+
+	spin_lock_init(&rt->lock);
+	INIT_KFIFO(rt->queue);
+	rt->queued = 0;
+	rt->done = 0;
+	rt->overflow = 0;
+
+	thread = kthread_create(ssh_event_rt_thread, rt, "surface_sh_evtrt");
+	if (IS_ERR(thread)) {
+		return PTR_ERR(thread);
+	}
+
+	if (param.sched_priority) {
+		sched_setscheduler_nocheck(thread, SCHED_FIFO, &param);
+	}
+
+	rt->thread = thread;
+	wake_up_process(thread);
+
+	return 0;
+}
+
+static void ssh_event_rt_stop(struct ssh_event_rt *rt)
+{
+	kthread_stop(rt->thread);
+	rt->thread = NULL;
+}
+
+/*
+ * Queue an immediate event. Returns false if the queue is full.
+ */
+static bool ssh_event_rt_queue(struct ssh_event_rt *rt, struct ssh_event_work *work)
+{
+	unsigned long flags;
+	bool queued;
+
+	spin_lock_irqsave(&rt->lock, flags);
+
+	queued = kfifo_put(&rt->queue, work);
+	if (queued) {
+		WRITE_ONCE(rt->queued, rt->queued + 1);
+	} else {
+		rt->overflow += 1;
+	}
+
+	spin_unlock_irqrestore(&rt->lock, flags);
+
+	if (queued) {
+		wake_up(&rt->waitq);
+	}
+
+	return queued;
+}
+
+/*
+ * Wait until all immediate events that have been queued before this call
+ * have been handled.
+ */
+static void ssh_event_rt_flush(struct ssh_event_rt *rt)
+{
+	unsigned long target = READ_ONCE(rt->queued);
+
+	wait_event(rt->idle, (long)(smp_load_acquire(&rt->done) - target) >= 0);
+}
+
+inline static bool ssh_event_matches(const struct surface_sam_ssh_event_subscriber *sub,
+				     u8 tc, u8 cid)
+{
+	if ((sub->flags & SURFACE_SAM_SSH_EVENT_MATCH_TC) && sub->tc != tc) {
+		return false;
+	}
+
+	if ((sub->flags & SURFACE_SAM_SSH_EVENT_MATCH_CID) && sub->cid != cid) {
+		return false;
+	}
+
+	return true;
+}
+
+static struct ssh_event_work *ssh_event_work_create(struct sam_ssh_ec *ec, const u8 *buf,
+						    ktime_t timestamp)
+{
+	const struct ssh_frame_ctrl *ctrl;
+	const struct ssh_frame_cmd *cmd;
+	struct ssh_event_work *work;
+
+	ctrl = (const struct ssh_frame_ctrl *)(buf + SSH_FRAME_OFFS_CTRL);
+	cmd  = (const struct ssh_frame_cmd  *)(buf + SSH_FRAME_OFFS_CMD);
+
+	work = ssh_event_work_get(&ec->events.pool);
+	if (!work) {
+		dev_warn_ratelimited(&ec->serdev->dev, SSH_EVENT_TAG
+				     "event pool exhausted, dropping event\n");
+		return NULL;
+	}
+
+	work->ec         = ec;
+	work->sub        = NULL;
+	work->event.rqid = (cmd->rqid_hi << 8) | cmd->rqid_lo;
+	work->event.tc   = cmd->tc;
+	work->event.iid  = cmd->iid;
+	work->event.cid  = cmd->cid;
+	work->event.len  = ctrl->len - SSH_BYTELEN_CMDFRAME;
+	work->event.pld  = work->pld;
+	work->event.timestamp = timestamp;
+
+	memcpy(work->event.pld, buf + SSH_FRAME_OFFS_CMD_PLD, work->event.len);
+	return work;
+}
+
+static void ssh_event_submit(struct sam_ssh_ec *ec, struct ssh_event_work *work)
+{
+	struct device *dev = &ec->serdev->dev;
+	struct surface_sam_ssh_event_subscriber *sub = work->sub;
+	unsigned long delay = 0;
+
+	if (sub->delay) {
+		delay = sub->delay(&work->event, sub->data);
+	}
+
+	/*
+	 * High priority events (e.g. keyboard) bypass the workqueue. If the
+	 * queue is full, drop the event: deferring it to the workqueue would
+	 * let later events of the subscriber overtake it.
+	 */
+	if (delay == SURFACE_SAM_SSH_EVENT_IMMEDIATE) {
+		if (!ssh_event_rt_queue(&ec->events.rt, work)) {
+			dev_warn_ratelimited(dev, SSH_EVENT_TAG "immediate-event queue full, dropping event\n");
+			ssh_event_work_release(work);
+		}
+		return;
+	}
+
+	if (!ssh_event_source_admit(ec, work)) {
+		dev_dbg(dev, SSH_EVENT_TAG "backlog full (rqid: %04x)\n", work->event.rqid);
+		return;
+	}
+
+	if (!delay) {
+		ssh_event_source_queue(ec, work);
+		return;
+	}
+
+	ssh_event_source_delay(ec, work, delay, sub->flags & SURFACE_SAM_SSH_EVENT_COALESCE);
+}
+
+/*
+ * Hand the event to every matching subscriber, each one gets its own copy so
+ * that delay, coalescing, and dispatch are independent of other subscribers.
+ * Returns false if there is no matching subscriber. Must be called under RCU.
+ */
+static bool ssh_event_deliver(struct sam_ssh_ec *ec, const u8 *buf, u16 rqid,
+			      ktime_t timestamp)
+{
+	const struct ssh_frame_cmd *cmd;
+	struct surface_sam_ssh_event_subscriber *sub;
+	struct ssh_event_work *work;
+	bool matched = false;
+
+	cmd = (const struct ssh_frame_cmd *)(buf + SSH_FRAME_OFFS_CMD);
+
+	list_for_each_entry_rcu(sub, &ec->events.subscribers[rqid - 1], node) {
+		if (!ssh_event_matches(sub, cmd->tc, cmd->cid)) {
+			continue;
+		}
+
+		matched = true;
+
+		work = ssh_event_work_create(ec, buf, timestamp);
+		if (!work) {
+			break;
+		}
+
+		atomic_inc(&sub->pending);
+		work->sub = sub;
+
+		ssh_event_submit(ec, work);
+	}
+
+	return matched;
+}
+
+/*
+ * Drop buffered events older than the age limit. Returns the remaining time
+ * until the next one expires in jiffies, or zero if none is left. Must be
+ * called with the events lock held.
+ */
+static unsigned long ssh_event_expire_early(struct sam_ssh_ec *ec, ktime_t now)
+{
+	struct ssh_event_work *work, *tmp;
+	s64 age, oldest = -1;
+	int i;
+
+	for (i = 0; i < SAM_NUM_EVENT_TYPES; i++) {
+		// the lists are in order of arrival
+		list_for_each_entry_safe(work, tmp, &ec->events.early[i], node) {
+			age = ktime_ms_delta(now, work->event.timestamp);
+			if (age < SSH_EVENT_EARLY_AGE_MS) {
+				oldest = max(oldest, age);
+				break;
+			}
+
+			list_del(&work->node);
+			ec->events.early_len[i] -= 1;
+			ec->events.early_total -= 1;
+
+			dev_dbg(&ec->serdev->dev, SSH_EVENT_TAG "buffered event expired (rqid: %04x)\n",
+				i + 1);
+			ssh_event_work_put(&ec->events.pool, work);
+		}
+	}
+
+	if (oldest < 0) {
+		return 0;
+	}
+
+	return msecs_to_jiffies(SSH_EVENT_EARLY_AGE_MS - oldest) + 1;
+}
+
+static void ssh_event_early_work_handler(struct work_struct *work)
+{
+	struct sam_ssh_ec *ec;
+	unsigned long flags;
+	unsigned long next;
+
+	ec = container_of(to_delayed_work(work), struct sam_ssh_ec, events.early_expire);
+
+	spin_lock_irqsave(&ec->events.lock, flags);
+	next = ssh_event_expire_early(ec, ktime_get());
+	if (next) {
+		queue_delayed_work(ec->events.queue_evt, &ec->events.early_expire, next);
+	}
+	spin_unlock_irqrestore(&ec->events.lock, flags);
+}
+
+/*
+ * Keep an event without subscriber for replay. If the buffer is full, the
+ * oldest buffered event of the same RQID makes room. Must be called with the
+ * events lock held.
+ */
+static void ssh_event_buffer_early(struct sam_ssh_ec *ec, const u8 *buf, u16 rqid,
+				   ktime_t timestamp)
+{
+	struct device *dev = &ec->serdev->dev;
+	struct list_head *early = &ec->events.early[rqid - 1];
+	struct ssh_event_work *work;
+
+	if (ec->events.early_len[rqid - 1] >= SSH_EVENT_EARLY_LEN
+	    || ec->events.early_total >= SSH_EVENT_EARLY_MAX) {
+		work = list_first_entry_or_null(early, struct ssh_event_work, node);
+		if (!work) {
+			dev_warn_ratelimited(dev, SSH_EVENT_TAG "unhandled event (rqid: %04x), dropping\n",
+					     rqid);
+			return;
+		}
+
+		list_del(&work->node);
+		ec->events.early_len[rqid - 1] -= 1;
+		ec->events.early_total -= 1;
+
+		dev_warn_ratelimited(dev, SSH_EVENT_TAG "unhandled event (rqid: %04x, tc: %02x, cid: %02x), dropping\n",
+				     rqid, work->event.tc, work->event.cid);
+		ssh_event_work_put(&ec->events.pool, work);
+	}
+
+	work = ssh_event_work_create(ec, buf, timestamp);
+	if (!work) {
+		return;
+	}
+
+	list_add_tail(&work->node, early);
+	ec->events.early_len[rqid - 1] += 1;
+	ec->events.early_total += 1;
+
+	// no-op if already queued, the handler re-arms for the next expiry
+	queue_delayed_work(ec->events.queue_evt, &ec->events.early_expire,
+			   msecs_to_jiffies(SSH_EVENT_EARLY_AGE_MS) + 1);
+
+	dev_dbg(dev, SSH_EVENT_TAG "buffering unhandled event (rqid: %04x)\n", rqid);
+}
+
+/*
+ * Submit all buffered events matching the new subscriber to it. Must be
+ * called with the events lock held.
+ */
+static void ssh_event_replay_early(struct sam_ssh_ec *ec,
+				   struct surface_sam_ssh_event_subscriber *sub)
+{
+	struct ssh_event_work *work, *tmp;
+
+	ssh_event_expire_early(ec, ktime_get());
+
+	list_for_each_entry_safe(work, tmp, &ec->events.early[sub->rqid - 1], node) {
+		if (!ssh_event_matches(sub, work->event.tc, work->event.cid)) {
+			continue;
+		}
+
+		list_del(&work->node);
+		ec->events.early_len[sub->rqid - 1] -= 1;
+		ec->events.early_total -= 1;
+
+		atomic_inc(&sub->pending);
+		work->sub = sub;
+
+		ssh_event_submit(ec, work);
+	}
+}
+
+static void ssh_event_free_early(struct sam_ssh_ec *ec)
+{
+	struct ssh_event_work *work, *tmp;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&ec->events.lock, flags);
+
+	for (i = 0; i < SAM_NUM_EVENT_TYPES; i++) {
+		list_for_each_entry_safe(work, tmp, &ec->events.early[i], node) {
+			list_del(&work->node);
+			ssh_event_work_put(&ec->events.pool, work);
+		}
+
+		ec->events.early_len[i] = 0;
+	}
+
+	ec->events.early_total = 0;
+	spin_unlock_irqrestore(&ec->events.lock, flags);
+}
+
+static void ssh_handle_event(struct sam_ssh_ec *ec, const u8 *buf, ktime_t timestamp)
+{
+	const struct ssh_frame_ctrl *ctrl;
+	const struct ssh_frame_cmd *cmd;
+	unsigned long flags;
+	u16 rqid;
+
+	ctrl = (const struct ssh_frame_ctrl *)(buf + SSH_FRAME_OFFS_CTRL);
+	cmd  = (const struct ssh_frame_cmd  *)(buf + SSH_FRAME_OFFS_CMD);
+	rqid = (cmd->rqid_hi << 8) | cmd->rqid_lo;
+
+	ssh_queue_ack(ec, ctrl->seq);
+
+	// drop outdated responses before any handler can query them again
+	ssh_cache_event(&ec->cache, cmd->tc);
+
+	rcu_read_lock();
+
+	if (!ssh_event_deliver(ec, buf, rqid, timestamp)) {
+		/*
+		 * Re-check under the events lock. Subscribing replays buffered
+		 * events and adds the subscriber under this lock, so the event
+		 * either reaches the new subscriber here or gets replayed.
+		 */
+		spin_lock_irqsave(&ec->events.lock, flags);
+		if (!ssh_event_deliver(ec, buf, rqid, timestamp)) {
+			ssh_event_buffer_early(ec, buf, rqid, timestamp);
+		}
+		spin_unlock_irqrestore(&ec->events.lock, flags);
+	}
+
+	rcu_read_unlock();
+}
+
+static void ssh_pending_ctrl(struct sam_ssh_ec *ec, const struct ssh_frame_ctrl *ctrl)
+{
+	struct device *dev = &ec->serdev->dev;
+	struct ssh_request *rq, *done = NULL;
+	unsigned long flags;
+	bool found = false;
+	int i;
+
+	spin_lock_irqsave(&ec->pending.lock, flags);
+
+	for (i = 0; i < SSH_PENDING_MAX; i++) {
+		rq = ec->pending.slot[i];
+		if (!rq || rq->state != SSH_RQST_PENDING_ACK) {
+			continue;
+		}
+
+		// RETRY applies to all unacknowledged frames (see transmitter)
+		if (ctrl->type != SSH_FRAME_TYPE_ACK) {
+			rq->resend = true;
+			found = true;
+			continue;
+		}
+
+		if (ctrl->seq != rq->seq) {
+			continue;
+		}
+
+		found = true;
+
+		// a re-transmission may have been scheduled just before the ACK
+		rq->resend = false;
+
+		// Karn's algorithm: no samples from re-transmitted frames
+		rq->acked = ktime_get();
+		if (rq->tries == 1) {
+			ssh_rtt_sample(&ec->rtt.ack, rq->sent, rq->acked);
+			ec->rtt.backoff = 0;
+		}
+
+		if (rq->expect_rsp) {
+			rq->state = SSH_RQST_PENDING_RSP;
+			rq->expires = jiffies + SSH_READ_TIMEOUT;
+			ssh_reaper_arm(ec, rq->expires);
+		} else {
+			ssh_pending_remove(ec, rq);
+			done = rq;
+		}
+		break;
+	}
 
-	spin_lock_irqsave(&ec->events.lock, flags);
-	handler       = ec->events.handler[event->rqid - 1].handler;
-	handler_data  = ec->events.handler[event->rqid - 1].data;
-	spin_unlock_irqrestore(&ec->events.lock, flags);
+	spin_unlock_irqrestore(&ec->pending.lock, flags);
 
 	/*
-	 * During handler removal or driver release, we ensure every event gets
-	 * handled before return of that function. Thus a handler obtained here is
-	 * guaranteed to be valid at least until this function returns.
+	 * An ACK without matching request is expected if the response has
+	 * been taken as implicit ACK before (see ssh_pending_rsp), or if the
+	 * request has been completed otherwise in the meantime.
 	 */
-
-	if (handler) {
-		status = handler(event, handler_data);
-	} else {
-		dev_warn(dev, SSH_EVENT_TAG "unhandled event (rqid: %04x)\n", event->rqid);
-	}
-
-	if (status) {
-		dev_err(dev, SSH_EVENT_TAG "error handling event: %d\n", status);
+	if (!found && ctrl->type == SSH_FRAME_TYPE_ACK) {
+		dev_dbg(dev, SSH_RECV_TAG "discarding message: ACK not expected\n");
+		return;
+	} else if (!found) {
+		dev_err(dev, SSH_RECV_TAG "discarding message: ctrl not expected\n");
+		return;
 	}
 
-	if (refcount_dec_and_test(&work->refcount)) {
-		kfree(work);
+	// either re-send or transmit next command
+	if (done) {
+		ssh_request_complete(done, 0);
+	} else {
+		queue_work(ec->pending.queue_tx, &ec->writer.work);
 	}
 }
 
-static void ssh_handle_event(struct sam_ssh_ec *ec, const u8 *buf)
+static void ssh_pending_rsp(struct sam_ssh_ec *ec, const struct ssh_frame_ctrl *ctrl,
+			    const struct ssh_frame_cmd *cmd, const u8 *pld, size_t len)
 {
 	struct device *dev = &ec->serdev->dev;
-	const struct ssh_frame_ctrl *ctrl;
-	const struct ssh_frame_cmd *cmd;
-	struct ssh_event_work *work;
+	struct ssh_request *rq;
 	unsigned long flags;
-	u16 pld_len;
+	u16 rqid = (cmd->rqid_hi << 8) | cmd->rqid_lo;
 
-	surface_sam_ssh_event_handler_delay delay_fn;
-	void *handler_data;
-	unsigned long delay = 0;
+	/*
+	 * ACK any valid message, even if we don't expect it any more (e.g. the
+	 * request has been cancelled or hit its deadline). Otherwise the EC
+	 * re-transmits it.
+	 */
+	ssh_queue_ack(ec, ctrl->seq);
 
-	ctrl = (const struct ssh_frame_ctrl *)(buf + SSH_FRAME_OFFS_CTRL);
-	cmd  = (const struct ssh_frame_cmd  *)(buf + SSH_FRAME_OFFS_CMD);
+	spin_lock_irqsave(&ec->pending.lock, flags);
 
-	pld_len = ctrl->len - SSH_BYTELEN_CMDFRAME;
+	// check if response is for any of our requests
+	rq = ec->pending.slot[ssh_pending_index(rqid)];
+	if (!rq || rq->rqid != rqid) {
+		spin_unlock_irqrestore(&ec->pending.lock, flags);
+		dev_dbg(dev, SSH_RECV_TAG "discarding message: command not a match\n");
+		return;
+	}
 
-	work = kzalloc(sizeof(struct ssh_event_work) + pld_len, GFP_ATOMIC);
-	if (!work) {
-		dev_warn(dev, SSH_EVENT_TAG "failed to allocate memory, dropping event\n");
+	// check if we expect the message
+	if (!rq->expect_rsp) {
+		spin_unlock_irqrestore(&ec->pending.lock, flags);
+		dev_dbg(dev, SSH_RECV_TAG "discarding message: command not expected\n");
 		return;
 	}
 
-	refcount_set(&work->refcount, 2);
-	work->ec         = ec;
-	work->seq        = ctrl->seq;
-	work->event.rqid = (cmd->rqid_hi << 8) | cmd->rqid_lo;
-	work->event.tc   = cmd->tc;
-	work->event.iid  = cmd->iid;
-	work->event.cid  = cmd->cid;
-	work->event.len  = pld_len;
-	work->event.pld  = ((u8*) work) + sizeof(struct ssh_event_work);
+	/*
+	 * A response with matching RQID can only be sent after the EC has
+	 * received our command, so treat it as implicit ACK in case the actual
+	 * ACK got lost. There's no reference point for sampling in that case.
+	 */
+	if (rq->state == SSH_RQST_PENDING_ACK) {
+		dev_dbg(dev, SSH_RECV_TAG "response without ACK, assuming implicit ACK\n");
+	} else if (rq->tries == 1) {
+		ssh_rtt_sample(&ec->rtt.rsp[rq->rqst.tc], rq->acked, ktime_get());
+	}
+
+	ssh_pending_remove(ec, rq);
+	spin_unlock_irqrestore(&ec->pending.lock, flags);
 
-	memcpy(work->event.pld, buf + SSH_FRAME_OFFS_CMD_PLD, pld_len);
+	// we now have a valid & expected command message
+	dev_dbg(dev, SSH_RECV_TAG "valid command message received\n");
 
-	INIT_WORK(&work->work_ack, surface_sam_ssh_event_work_ack_handler);
-	queue_work(ec->events.queue_ack, &work->work_ack);
+	ssh_request_complete_rsp(rq, 0, pld, len);
+}
 
-	spin_lock_irqsave(&ec->events.lock, flags);
-	handler_data = ec->events.handler[work->event.rqid - 1].data;
-	delay_fn     = ec->events.handler[work->event.rqid - 1].delay;
-	if (delay_fn) {
-		delay = delay_fn(&work->event, handler_data);
+/*
+ * Skip an invalid message by scanning for the next SYN after its start.
+ * Returns the number of bytes to skip. A trailing 0xaa is kept as it may be
+ * the first half of a SYN split across two receive calls.
+ */
+static int ssh_receive_resync(struct sam_ssh_ec *ec, const u8 *buf, size_t size)
+{
+	size_t n;
+
+	for (n = 1; n + 1 < size; n++) {
+		if (ssh_is_valid_syn(buf + n)) {
+			break;
+		}
 	}
-	spin_unlock_irqrestore(&ec->events.lock, flags);
 
-	// immediate execution for high priority events (e.g. keyboard)
-	if (delay == SURFACE_SAM_SSH_EVENT_IMMEDIATE) {
-		surface_sam_ssh_event_work_evt_handler(&work->work_evt.work);
-	} else {
-		INIT_DELAYED_WORK(&work->work_evt, surface_sam_ssh_event_work_evt_handler);
-		queue_delayed_work(ec->events.queue_evt, &work->work_evt, delay);
+	if (n + 1 == size && buf[n] != 0xaa) {
+		n = size;
 	}
+
+	ec->receiver.skipped += n;
+	return n;
 }
 
 static int ssh_receive_msg_ctrl(struct sam_ssh_ec *ec, const u8 *buf, size_t size)
 {
 	struct device *dev = &ec->serdev->dev;
-	struct ssh_receiver *rcv = &ec->receiver;
 	const struct ssh_frame_ctrl *ctrl;
-	struct ssh_fifo_packet packet;
 
 	const u8 *ctrl_begin = buf + SSH_FRAME_OFFS_CTRL;
 	const u8 *ctrl_end   = buf + SSH_FRAME_OFFS_CTRL_CRC;
@@ -990,63 +3462,54 @@ static int ssh_receive_msg_ctrl(struct sam_ssh_ec *ec, const u8 *buf, size_t siz
 	// validate TERM
 	if (!ssh_is_valid_ter(buf + SSH_FRAME_OFFS_TERM)) {
 		dev_err(dev, SSH_RECV_TAG "invalid end of message\n");
-		return size;			// discard everything
+		return ssh_receive_resync(ec, buf, size);
 	}
 
 	// validate CRC
 	if (!ssh_is_valid_crc(ctrl_begin, ctrl_end)) {
 		dev_err(dev, SSH_RECV_TAG "invalid checksum (ctrl)\n");
-		return SSH_MSG_LEN_CTRL;	// only discard message
-	}
-
-	// check if we expect the message
-	if (rcv->state != SSH_RCV_CONTROL) {
-		dev_err(dev, SSH_RECV_TAG "discarding message: ctrl not expected\n");
-		return SSH_MSG_LEN_CTRL;	// discard message
-	}
-
-	// check if it is for our request
-	if (ctrl->type == SSH_FRAME_TYPE_ACK && ctrl->seq != rcv->expect.seq) {
-		dev_err(dev, SSH_RECV_TAG "discarding message: ack does not match\n");
-		return SSH_MSG_LEN_CTRL;	// discard message
+		return ssh_receive_resync(ec, buf, size);
 	}
 
-	// we now have a valid & expected ACK/RETRY message
+	// we now have a valid ACK/RETRY message
 	dev_dbg(dev, SSH_RECV_TAG "valid control message received (type: 0x%02x)\n", ctrl->type);
 
-	packet.type = ctrl->type;
-	packet.seq  = ctrl->seq;
-	packet.len  = 0;
-
-	if (kfifo_avail(&rcv->fifo) >= sizeof(packet)) {
-		kfifo_in(&rcv->fifo, (u8 *) &packet, sizeof(packet));
+	ssh_pending_ctrl(ec, ctrl);
+	return SSH_MSG_LEN_CTRL;		// handled message
+}
 
-	} else {
-		dev_warn(dev, SSH_RECV_TAG
-			 "dropping frame: not enough space in fifo (type = %d)\n",
-			 SSH_FRAME_TYPE_CMD);
+/*
+ * Check if a command message has been received recently and remember it
+ * otherwise. The EC re-transmits messages with the same sequence ID if our
+ * ACK is late or got lost. Called with the receiver lock held.
+ */
+static bool ssh_rcv_is_duplicate(struct ssh_receiver *rcv, u8 seq, u16 rqid)
+{
+	unsigned int i;
 
-		return SSH_MSG_LEN_CTRL;	// discard message
+	for (i = 0; i < rcv->recent.len; i++) {
+		if (rcv->recent.seq[i] == seq && rcv->recent.rqid[i] == rqid) {
+			return true;
+		}
 	}
 
-	// update decoder state
-	if (ctrl->type == SSH_FRAME_TYPE_ACK) {
-		rcv->state = rcv->expect.pld
-			? SSH_RCV_COMMAND
-			: SSH_RCV_DISCARD;
+	rcv->recent.seq[rcv->recent.head]  = seq;
+	rcv->recent.rqid[rcv->recent.head] = rqid;
+	rcv->recent.head = (rcv->recent.head + 1) % SSH_RCV_RECENT_LEN;
+
+	if (rcv->recent.len < SSH_RCV_RECENT_LEN) {
+		rcv->recent.len += 1;
 	}
 
-	complete(&rcv->signal);
-	return SSH_MSG_LEN_CTRL;		// handled message
+	return false;
 }
 
-static int ssh_receive_msg_cmd(struct sam_ssh_ec *ec, const u8 *buf, size_t size)
+static int ssh_receive_msg_cmd(struct sam_ssh_ec *ec, const u8 *buf, size_t size,
+			       struct ssh_rcv_state *state)
 {
 	struct device *dev = &ec->serdev->dev;
-	struct ssh_receiver *rcv = &ec->receiver;
 	const struct ssh_frame_ctrl *ctrl;
 	const struct ssh_frame_cmd *cmd;
-	struct ssh_fifo_packet packet;
 
 	const u8 *ctrl_begin     = buf + SSH_FRAME_OFFS_CTRL;
 	const u8 *ctrl_end       = buf + SSH_FRAME_OFFS_CTRL_CRC;
@@ -1054,24 +3517,47 @@ static int ssh_receive_msg_cmd(struct sam_ssh_ec *ec, const u8 *buf, size_t size
 	const u8 *cmd_begin_pld  = buf + SSH_FRAME_OFFS_CMD_PLD;
 	const u8 *cmd_end;
 
-	size_t msg_len;
+	size_t msg_len, crc_end;
+	u16 rqid;
 
 	ctrl = (const struct ssh_frame_ctrl *)(ctrl_begin);
 	cmd  = (const struct ssh_frame_cmd  *)(cmd_begin);
 
-	// we need at least a full control frame
-	if (size < (SSH_BYTELEN_SYNC + SSH_BYTELEN_CTRL + SSH_BYTELEN_CRC)) {
-		return 0;		// need more bytes
+	if (state->stage == SSH_RCV_HDR) {
+		// we need at least a full control frame
+		if (size < (SSH_BYTELEN_SYNC + SSH_BYTELEN_CTRL + SSH_BYTELEN_CRC)) {
+			return 0;		// need more bytes
+		}
+
+		// validate control-frame CRC
+		if (!ssh_is_valid_crc(ctrl_begin, ctrl_end)) {
+			dev_err(dev, SSH_RECV_TAG "invalid checksum (cmd-ctrl)\n");
+			/*
+			 * We can't be sure here if length is valid, thus
+			 * look for the next message.
+			 */
+			return ssh_receive_resync(ec, buf, size);
+		}
+
+		// the command frame has to contain at least its header
+		if (ctrl->len < SSH_BYTELEN_CMDFRAME) {
+			dev_err(dev, SSH_RECV_TAG "command frame too short\n");
+			return ssh_receive_resync(ec, buf, size);
+		}
+
+		state->stage    = SSH_RCV_BODY;
+		state->crc      = 0xffff;
+		state->crc_offs = SSH_FRAME_OFFS_CMD;
 	}
 
-	// validate control-frame CRC
-	if (!ssh_is_valid_crc(ctrl_begin, ctrl_end)) {
-		dev_err(dev, SSH_RECV_TAG "invalid checksum (cmd-ctrl)\n");
-		/*
-		 * We can't be sure here if length is valid, thus
-		 * discard everything.
-		 */
-		return size;
+	cmd_end = cmd_begin + ctrl->len;
+
+	// fold the command-frame bytes received so far into the CRC
+	crc_end = min(size, (size_t)(SSH_FRAME_OFFS_CMD + ctrl->len));
+	if (crc_end > state->crc_offs) {
+		state->crc = ssh_crc_update(state->crc, buf + state->crc_offs,
+					    crc_end - state->crc_offs);
+		state->crc_offs = crc_end;
 	}
 
 	// actual length check (ctrl->len contains command-frame but not crc)
@@ -1080,16 +3566,14 @@ static int ssh_receive_msg_cmd(struct sam_ssh_ec *ec, const u8 *buf, size_t size
 		return 0;			// need more bytes
 	}
 
-	cmd_end = cmd_begin + ctrl->len;
-
 	// validate command-frame type
 	if (cmd->type != SSH_FRAME_TYPE_CMD) {
 		dev_err(dev, SSH_RECV_TAG "expected command frame type but got 0x%02x\n", cmd->type);
-		return size;			// discard everything
+		return ssh_receive_resync(ec, buf, size);
 	}
 
 	// validate command-frame CRC
-	if (!ssh_is_valid_crc(cmd_begin, cmd_end)) {
+	if (!ssh_crc_matches(state->crc, cmd_end)) {
 		dev_err(dev, SSH_RECV_TAG "invalid checksum (cmd-pld)\n");
 
 		/*
@@ -1100,79 +3584,108 @@ static int ssh_receive_msg_cmd(struct sam_ssh_ec *ec, const u8 *buf, size_t size
 		return msg_len;
 	}
 
+	rqid = (cmd->rqid_hi << 8) | cmd->rqid_lo;
+
+	// re-transmission: our ACK got lost or was late, ACK again but don't handle
+	if (ssh_rcv_is_duplicate(&ec->receiver, ctrl->seq, rqid)) {
+		dev_dbg(dev, SSH_RECV_TAG "duplicate message (seq: 0x%02x, rqid: 0x%04x)\n",
+			ctrl->seq, rqid);
+
+		ec->receiver.duplicates += 1;
+		ssh_queue_ack(ec, ctrl->seq);
+		return msg_len;
+	}
+
 	// check if we received an event notification
-	if (sam_rqid_is_event((cmd->rqid_hi << 8) | cmd->rqid_lo)) {
-		ssh_handle_event(ec, buf);
+	if (sam_rqid_is_event(rqid)) {
+		ssh_handle_event(ec, buf, ec->receiver.timestamp);
 		return msg_len;			// handled message
 	}
 
-	// check if we expect the message
-	if (rcv->state != SSH_RCV_COMMAND) {
-		dev_dbg(dev, SSH_RECV_TAG "discarding message: command not expected\n");
-		return msg_len;			// discard message
-	}
+	ssh_pending_rsp(ec, ctrl, cmd, cmd_begin_pld, cmd_end - cmd_begin_pld);
+	return msg_len;				// handled message
+}
 
-	// check if response is for our request
-	if (rcv->expect.rqid != (cmd->rqid_lo | (cmd->rqid_hi << 8))) {
-		dev_dbg(dev, SSH_RECV_TAG "discarding message: command not a match\n");
-		return msg_len;			// discard message
-	}
+/*
+ * Evaluate the message at the start of buf. The state records what has
+ * already been validated, so that a message delivered in multiple chunks is
+ * not re-checked from SYN on every call and the CRC of its command frame is
+ * computed as the bytes arrive. It is reset once the message has been
+ * consumed.
+ */
+static int ssh_eval_buf(struct sam_ssh_ec *ec, const u8 *buf, size_t size,
+			struct ssh_rcv_state *state)
+{
+	struct device *dev = &ec->serdev->dev;
+	struct ssh_frame_ctrl *ctrl;
+	int n;
 
-	// we now have a valid & expected command message
-	dev_dbg(dev, SSH_RECV_TAG "valid command message received\n");
+	if (state->stage == SSH_RCV_SYNC) {
+		// we need at least a control frame to check what to do
+		if (size < (SSH_BYTELEN_SYNC + SSH_BYTELEN_CTRL)) {
+			return 0;		// need more bytes
+		}
 
-	packet.type = ctrl->type;
-	packet.seq = ctrl->seq;
-	packet.len = cmd_end - cmd_begin_pld;
+		// make sure we're actually at the start of a new message
+		if (!ssh_is_valid_syn(buf)) {
+			dev_err(dev, SSH_RECV_TAG "invalid start of message\n");
+			return ssh_receive_resync(ec, buf, size);
+		}
 
-	if (kfifo_avail(&rcv->fifo) >= sizeof(packet) + packet.len) {
-		kfifo_in(&rcv->fifo, &packet, sizeof(packet));
-		kfifo_in(&rcv->fifo, cmd_begin_pld, packet.len);
+		state->stage = SSH_RCV_HDR;
+	}
 
-	} else {
-		dev_warn(dev, SSH_RECV_TAG
-			 "dropping frame: not enough space in fifo (type = %d)\n",
-			 SSH_FRAME_TYPE_CMD);
+	// handle individual message types seperately
+	ctrl = (struct ssh_frame_ctrl *)(buf + SSH_FRAME_OFFS_CTRL);
+
+	switch (ctrl->type) {
+	case SSH_FRAME_TYPE_ACK:
+	case SSH_FRAME_TYPE_RETRY:
+		n = ssh_receive_msg_ctrl(ec, buf, size);
+		break;
+
+	case SSH_FRAME_TYPE_CMD:
+		n = ssh_receive_msg_cmd(ec, buf, size, state);
+		break;
 
-		return SSH_MSG_LEN_CTRL;	// discard message
+	default:
+		dev_err(dev, SSH_RECV_TAG "unknown frame type 0x%02x\n", ctrl->type);
+		n = ssh_receive_resync(ec, buf, size);
+		break;
 	}
 
-	rcv->state = SSH_RCV_DISCARD;
+	if (n > 0) {
+		state->stage = SSH_RCV_SYNC;
+	}
 
-	complete(&rcv->signal);
-	return msg_len;				// handled message
+	return n;
 }
 
-static int ssh_eval_buf(struct sam_ssh_ec *ec, const u8 *buf, size_t size)
+/*
+ * Length of the message starting at buf, based on its (not yet validated)
+ * control frame. Returns zero if more bytes are required to determine it and
+ * size for invalid messages, which are left to ssh_eval_buf to discard.
+ */
+static size_t ssh_msg_len(const u8 *buf, size_t size)
 {
-	struct device *dev = &ec->serdev->dev;
-	struct ssh_frame_ctrl *ctrl;
+	const struct ssh_frame_ctrl *ctrl;
 
-	// we need at least a control frame to check what to do
 	if (size < (SSH_BYTELEN_SYNC + SSH_BYTELEN_CTRL)) {
-		return 0;		// need more bytes
+		return 0;
 	}
 
-	// make sure we're actually at the start of a new message
-	if (!ssh_is_valid_syn(buf)) {
-		dev_err(dev, SSH_RECV_TAG "invalid start of message\n");
-		return size;		// discard everything
-	}
-
-	// handle individual message types seperately
-	ctrl = (struct ssh_frame_ctrl *)(buf + SSH_FRAME_OFFS_CTRL);
+	ctrl = (const struct ssh_frame_ctrl *)(buf + SSH_FRAME_OFFS_CTRL);
 
 	switch (ctrl->type) {
 	case SSH_FRAME_TYPE_ACK:
 	case SSH_FRAME_TYPE_RETRY:
-		return ssh_receive_msg_ctrl(ec, buf, size);
+		return SSH_MSG_LEN_CTRL;
 
 	case SSH_FRAME_TYPE_CMD:
-		return ssh_receive_msg_cmd(ec, buf, size);
+		return SSH_MSG_LEN_CMD_BASE + ctrl->len;
 
 	default:
-		dev_err(dev, SSH_RECV_TAG "unknown frame type 0x%02x\n", ctrl->type);
-		return size;		// discard everything
+		return size;
 	}
 }
 
@@ -1181,41 +3694,85 @@ static int ssh_receive_buf(struct serdev_device *serdev,
 {
 	struct sam_ssh_ec *ec = serdev_device_get_drvdata(serdev);
 	struct ssh_receiver *rcv = &ec->receiver;
-	unsigned long flags;
-	int offs = 0;
-	int used, n;
+	size_t offs = 0;
+	struct ssh_rcv_state state;
+	size_t need, n;
+	int used;
 
 	dev_dbg(&serdev->dev, SSH_RECV_TAG "received buffer (size: %zu)\n", size);
 	print_hex_dump_debug(SSH_RECV_TAG, DUMP_PREFIX_OFFSET, 16, 1, buf, size, false);
 
 	/*
-	 * The battery _BIX message gets a bit long, thus we have to add some
-	 * additional buffering here.
+	 * Messages are parsed directly from the serdev buffer. Only a message
+	 * split across multiple calls (e.g. the long battery _BIX response) is
+	 * assembled in the frame buffer, which thus never holds more than one
+	 * message. We're called from the tty flip-buffer work, so there's no
+	 * need to disable interrupts here.
+	 */
+
+	spin_lock(&rcv->lock);
+
+	/*
+	 * Any message completed in this call has its last byte in this buffer,
+	 * so this is the time the message has been received.
 	 */
+	rcv->timestamp = ktime_get();
 
-	spin_lock_irqsave(&rcv->lock, flags);
+	// complete the message left over from the previous call first
+	while (rcv->frame.len) {
+		need = ssh_msg_len(rcv->frame.ptr, rcv->frame.len);
+		if (!need) {
+			need = SSH_BYTELEN_SYNC + SSH_BYTELEN_CTRL;
+		}
+
+		n = 0;
+		if (rcv->frame.len < need) {
+			n = min(need - rcv->frame.len, size - offs);
+			memcpy(rcv->frame.ptr + rcv->frame.len, buf + offs, n);
+			rcv->frame.len += n;
+			offs += n;
+		}
+
+		// continue where the previous evaluation stopped
+		used = ssh_eval_buf(ec, rcv->frame.ptr, rcv->frame.len, &rcv->frame.state);
+		if (used <= 0) {
+			if (!n) {
+				break;		// need more bytes
+			}
+			continue;
+		}
 
-	// copy to eval-buffer
-	used = min(size, (size_t)(rcv->eval_buf.cap - rcv->eval_buf.len));
-	memcpy(rcv->eval_buf.ptr + rcv->eval_buf.len, buf, used);
-	rcv->eval_buf.len += used;
+		/*
+		 * Only after resynchronization the frame buffer may still hold
+		 * the start of the next message.
+		 */
+		rcv->frame.len -= used;
+		if (rcv->frame.len) {
+			memmove(rcv->frame.ptr, rcv->frame.ptr + used, rcv->frame.len);
+		}
+	}
 
-	// evaluate buffer until we need more bytes or eval-buf is empty
-	while (offs < rcv->eval_buf.len) {
-		n = rcv->eval_buf.len - offs;
-		n = ssh_eval_buf(ec, rcv->eval_buf.ptr + offs, n);
-		if (n <= 0) break;	// need more bytes
+	// evaluate buffer in-place until we need more bytes
+	state.stage = SSH_RCV_SYNC;
+	while (offs < size) {
+		used = ssh_eval_buf(ec, buf + offs, size - offs, &state);
+		if (used <= 0) {
+			break;
+		}
 
-		offs += n;
+		offs += used;
 	}
 
-	// throw away the evaluated parts
-	rcv->eval_buf.len -= offs;
-	memmove(rcv->eval_buf.ptr, rcv->eval_buf.ptr + offs, rcv->eval_buf.len);
+	// keep the partial message and its evaluation state, it is guaranteed to fit
+	if (offs < size) {
+		rcv->frame.state = state;
+		memcpy(rcv->frame.ptr, buf + offs, size - offs);
+		rcv->frame.len = size - offs;
+	}
 
-	spin_unlock_irqrestore(&rcv->lock, flags);
+	spin_unlock(&rcv->lock);
 
-	return used;
+	return size;
 }
 
 
@@ -1328,6 +3885,9 @@ static int surface_sam_ssh_suspend(struct device *dev)
 
 	ec = surface_sam_ssh_acquire_init();
 	if (ec) {
+		// let requests submitted before suspension finish
+		ssh_pending_wait_idle(ec);
+
 		status = surface_sam_ssh_ec_suspend(ec);
 		if (status) {
 			dev_err(dev, "failed to suspend EC: %d\n", status);
@@ -1349,6 +3909,14 @@ static int surface_sam_ssh_resume(struct device *dev)
 
 	ec = surface_sam_ssh_acquire_init();
 	if (ec) {
+		// the EC may have restarted its sequence IDs
+		spin_lock(&ec->receiver.lock);
+		ec->receiver.recent.len = 0;
+		spin_unlock(&ec->receiver.lock);
+
+		// anything may have changed while we were suspended
+		ssh_cache_invalidate_all(&ec->cache);
+
 		ec->state = SSH_EC_INITIALIZED;
 
 		status = surface_sam_ssh_ec_resume(ec);
@@ -1365,23 +3933,256 @@ static int surface_sam_ssh_resume(struct device *dev)
 static SIMPLE_DEV_PM_OPS(surface_sam_ssh_pm_ops, surface_sam_ssh_suspend, surface_sam_ssh_resume);
 
 
+static void ssh_write_wakeup(struct serdev_device *serdev)
+{
+	struct sam_ssh_ec *ec = serdev_device_get_drvdata(serdev);
+
+	// the UART has room again, continue writing
+	queue_work(ec->pending.queue_tx, &ec->writer.work);
+}
+
 static const struct serdev_device_ops ssh_device_ops = {
 	.receive_buf  = ssh_receive_buf,
-	.write_wakeup = serdev_device_write_wakeup,
+	.write_wakeup = ssh_write_wakeup,
 };
 
 
 int surface_sam_ssh_sysfs_register(struct device *dev);
 void surface_sam_ssh_sysfs_unregister(struct device *dev);
 
+
+#define SSH_CRC_BENCH_ITERATIONS	10000
+
+/*
+ * Compare the slice-by-8 CRC against the byte-wise crc_ccitt_false for the
+ * sizes of control frames, empty command frames, and up to full command
+ * frames. Reports the average time per CRC in nanoseconds.
+ */
+static int ssh_debugfs_crc_bench_show(struct seq_file *m, void *v)
+{
+	static const size_t sizes[] = {
+		SSH_BYTELEN_CTRL,
+		SSH_BYTELEN_CMDFRAME,
+		16, 32, 64, 128,
+		SSH_BYTELEN_CMDFRAME + SURFACE_SAM_SSH_MAX_RQST_PAYLOAD,
+	};
+
+	const size_t len = SSH_BYTELEN_CMDFRAME + SURFACE_SAM_SSH_MAX_RQST_PAYLOAD;
+	u64 t_ref, t_fast;
+	u16 c_ref, c_fast;
+	u8 *buf;
+	int i, j;
+
+	buf = kmalloc(len, GFP_KERNEL);
+	if (!buf) {
+		return -ENOMEM;
+	}
+
+	get_random_bytes(buf, len);
+
+	seq_puts(m, "size   crc_ccitt_false [ns]   slice-by-8 [ns]\n");
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		c_ref = 0;
+		c_fast = 0;
+
+		t_ref = ktime_get_ns();
+		for (j = 0; j < SSH_CRC_BENCH_ITERATIONS; j++) {
+			c_ref ^= crc_ccitt_false(0xffff, buf, sizes[i]);
+		}
+		t_ref = ktime_get_ns() - t_ref;
+
+		t_fast = ktime_get_ns();
+		for (j = 0; j < SSH_CRC_BENCH_ITERATIONS; j++) {
+			c_fast ^= ssh_crc(buf, sizes[i]);
+		}
+		t_fast = ktime_get_ns() - t_fast;
+
+		seq_printf(m, "%4zu   %20llu   %15llu%s\n", sizes[i],
+			   t_ref / SSH_CRC_BENCH_ITERATIONS,
+			   t_fast / SSH_CRC_BENCH_ITERATIONS,
+			   c_ref != c_fast ? "   (mismatch)" : "");
+
+		cond_resched();
+	}
+
+	kfree(buf);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ssh_debugfs_crc_bench);
+
+static int ssh_debugfs_rtt_show(struct seq_file *m, void *v)
+{
+	struct sam_ssh_ec *ec = m->private;
+	struct ssh_rtt_stats *rtt = &ec->rtt;
+	unsigned long flags;
+	int tc;
+
+	spin_lock_irqsave(&ec->pending.lock, flags);
+
+	seq_puts(m, "         srtt [us]   rttvar [us]   rto [us]   samples\n");
+	seq_printf(m, "ack     %10u    %10u   %8u   %7u   (backoff: %u)\n",
+		   rtt->ack.srtt, rtt->ack.rttvar, ssh_rtt_rto_us(&rtt->ack),
+		   rtt->ack.samples, rtt->backoff);
+
+	for (tc = 0; tc < SSH_NUM_TC; tc++) {
+		if (!rtt->rsp[tc].samples) {
+			continue;
+		}
+
+		seq_printf(m, "rsp %02x  %10u    %10u   %8u   %7u\n", tc,
+			   rtt->rsp[tc].srtt, rtt->rsp[tc].rttvar,
+			   ssh_rtt_rto_us(&rtt->rsp[tc]), rtt->rsp[tc].samples);
+	}
+
+	spin_unlock_irqrestore(&ec->pending.lock, flags);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ssh_debugfs_rtt);
+
+static int ssh_debugfs_rqst_classes_show(struct seq_file *m, void *v)
+{
+	struct sam_ssh_ec *ec = m->private;
+	struct ssh_rqst_class *class;
+	unsigned long flags;
+	int i;
+
+	seq_puts(m, "class         depth   max   dispatched      aged"
+		    "   wait avg [us]   max [us]\n");
+
+	spin_lock_irqsave(&ec->pending.lock, flags);
+
+	for (i = 0; i < ARRAY_SIZE(ssh_rqst_prio_order); i++) {
+		class = &ec->pending.class[ssh_rqst_prio_order[i]];
+
+		seq_printf(m, "%-11s %7u %5u %12llu %9llu %15llu %10llu\n",
+			   ssh_rqst_prio_name[ssh_rqst_prio_order[i]],
+			   class->depth, class->depth_max, class->dispatched,
+			   class->aged,
+			   div64_u64(class->wait_ns, max_t(u64, class->dispatched, 1))
+			    / NSEC_PER_USEC,
+			   div64_u64(class->wait_max_ns, NSEC_PER_USEC));
+	}
+
+	spin_unlock_irqrestore(&ec->pending.lock, flags);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ssh_debugfs_rqst_classes);
+
+static int ssh_debugfs_rqst_cache_show(struct seq_file *m, void *v)
+{
+	struct ssh_cache *cache = m->private;
+	unsigned long flags;
+	int tc;
+
+	seq_puts(m, "tc        hits     misses   invalidated\n");
+
+	spin_lock_irqsave(&cache->lock, flags);
+
+	for (tc = 0; tc < SSH_NUM_TC; tc++) {
+		if (!cache->hits[tc] && !cache->misses[tc] && !cache->invalidated[tc]) {
+			continue;
+		}
+
+		seq_printf(m, "%02x  %10llu %10llu %13llu\n", tc, cache->hits[tc],
+			   cache->misses[tc], cache->invalidated[tc]);
+	}
+
+	spin_unlock_irqrestore(&cache->lock, flags);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ssh_debugfs_rqst_cache);
+
+static int ssh_debugfs_event_pool_show(struct seq_file *m, void *v)
+{
+	struct ssh_event_pool *pool = m->private;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	seq_printf(m, "size:      %u\n", SSH_EVENT_POOL_SIZE);
+	seq_printf(m, "used:      %u\n", pool->used);
+	seq_printf(m, "high:      %u\n", pool->high);
+	seq_printf(m, "exhausted: %llu\n", pool->exhausted);
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ssh_debugfs_event_pool);
+
+static int ssh_debugfs_event_sources_show(struct seq_file *m, void *v)
+{
+	struct sam_ssh_ec *ec = m->private;
+	struct ssh_event_source *src;
+	unsigned long flags;
+	int i;
+
+	seq_puts(m, "rqid   backlog   depth   max   handled   coalesced   dropped"
+		    "   latency avg [us]   max [us]   runtime avg [us]   max [us]\n");
+
+	for (i = 0; i < SAM_NUM_EVENT_TYPES; i++) {
+		src = &ec->events.source[i];
+
+		spin_lock_irqsave(&src->lock, flags);
+		if (src->handled || src->backlog || src->coalesced || src->dropped) {
+			seq_printf(m, "%04x %9u %7u %5u %9llu %11llu %9llu %18llu %10llu %18llu %10llu\n",
+				   i + 1, src->backlog, src->depth, src->depth_max, src->handled,
+				   src->coalesced, src->dropped,
+				   div64_u64(src->latency_ns, max_t(u64, src->handled, 1))
+				    / NSEC_PER_USEC,
+				   div64_u64(src->latency_max_ns, NSEC_PER_USEC),
+				   div64_u64(src->runtime_ns, max_t(u64, src->handled, 1))
+				    / NSEC_PER_USEC,
+				   div64_u64(src->runtime_max_ns, NSEC_PER_USEC));
+		}
+		spin_unlock_irqrestore(&src->lock, flags);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ssh_debugfs_event_sources);
+
+static void ssh_debugfs_init(struct sam_ssh_ec *ec)
+{
+	ec->debugfs = debugfs_create_dir("surface_sam_ssh", NULL);
+
+	debugfs_create_u64("rx_skipped_bytes", 0400, ec->debugfs,
+			   &ec->receiver.skipped);
+	debugfs_create_u64("rx_duplicates", 0400, ec->debugfs,
+			   &ec->receiver.duplicates);
+	debugfs_create_file("rtt", 0400, ec->debugfs, ec,
+			    &ssh_debugfs_rtt_fops);
+	debugfs_create_file("rqst_classes", 0400, ec->debugfs, ec,
+			    &ssh_debugfs_rqst_classes_fops);
+	debugfs_create_u64("rqst_shared", 0400, ec->debugfs,
+			   &ec->pending.shared);
+	debugfs_create_file("rqst_cache", 0400, ec->debugfs, &ec->cache,
+			    &ssh_debugfs_rqst_cache_fops);
+	debugfs_create_file("event_pool", 0400, ec->debugfs, &ec->events.pool,
+			    &ssh_debugfs_event_pool_fops);
+	debugfs_create_u64("event_rt_overflow", 0400, ec->debugfs,
+			   &ec->events.rt.overflow);
+	debugfs_create_file("event_sources", 0400, ec->debugfs, ec,
+			    &ssh_debugfs_event_sources_fops);
+
+	debugfs_create_file("crc_bench", 0400, ec->debugfs, ec,
+			    &ssh_debugfs_crc_bench_fops);
+}
+
+static void ssh_debugfs_exit(struct sam_ssh_ec *ec)
+{
+	debugfs_remove_recursive(ec->debugfs);
+	ec->debugfs = NULL;
+}
+
 static int surface_sam_ssh_probe(struct serdev_device *serdev)
 {
 	struct sam_ssh_ec *ec;
-	struct workqueue_struct *event_queue_ack;
 	struct workqueue_struct *event_queue_evt;
+	struct workqueue_struct *rqst_queue_tx;
+	struct ssh_event_work *event_pool;
 	u8 *write_buf;
-	u8 *read_buf;
-	u8 *eval_buf;
+	int i;
+	u8 *frame_buf;
 	acpi_handle *ssh = ACPI_HANDLE(&serdev->dev);
 	acpi_status status;
 
@@ -1393,6 +4194,8 @@ static int surface_sam_ssh_probe(struct serdev_device *serdev)
 		return status;
 	}
 
+	ssh_crc_init();
+
 	// allocate buffers
 	write_buf = kzalloc(SSH_WRITE_BUF_LEN, GFP_KERNEL);
 	if (!write_buf) {
@@ -1400,28 +4203,31 @@ static int surface_sam_ssh_probe(struct serdev_device *serdev)
 		goto err_write_buf;
 	}
 
-	read_buf = kzalloc(SSH_READ_BUF_LEN, GFP_KERNEL);
-	if (!read_buf) {
+	frame_buf = kzalloc(SSH_FRAME_BUF_LEN, GFP_KERNEL);
+	if (!frame_buf) {
 		status = -ENOMEM;
-		goto err_read_buf;
+		goto err_frame_buf;
 	}
 
-	eval_buf = kzalloc(SSH_EVAL_BUF_LEN, GFP_KERNEL);
-	if (!eval_buf) {
+	event_pool = kcalloc(SSH_EVENT_POOL_SIZE, sizeof(struct ssh_event_work),
+			     GFP_KERNEL);
+	if (!event_pool) {
 		status = -ENOMEM;
-		goto err_eval_buf;
+		goto err_evt_pool;
 	}
 
-	event_queue_ack = create_singlethread_workqueue("surface_sh_ackq");
-	if (!event_queue_ack) {
+	// one worker per source at most, see struct ssh_event_source
+	event_queue_evt = alloc_workqueue("surface_sh_evtq", WQ_UNBOUND,
+					  SAM_NUM_EVENT_TYPES);
+	if (!event_queue_evt) {
 		status = -ENOMEM;
-		goto err_ackq;
+		goto err_evtq;
 	}
 
-	event_queue_evt = create_workqueue("surface_sh_evtq");
-	if (!event_queue_evt) {
+	rqst_queue_tx = create_singlethread_workqueue("surface_sh_rqstq");
+	if (!rqst_queue_tx) {
 		status = -ENOMEM;
-		goto err_evtq;
+		goto err_rqstq;
 	}
 
 	// set up EC
@@ -1434,20 +4240,50 @@ static int surface_sam_ssh_probe(struct serdev_device *serdev)
 		goto err_busy;
 	}
 
+	status = ssh_event_rt_start(&ec->events.rt);
+	if (status) {
+		surface_sam_ssh_release(ec);
+		goto err_busy;
+	}
+
 	ec->serdev      = serdev;
 	ec->writer.data = write_buf;
 	ec->writer.ptr  = write_buf;
+	ec->writer.head = write_buf;
+	ec->writer.n_burst = 0;
+	ec->writer.n_ack = 0;
+	INIT_WORK(&ec->writer.work, ssh_tx_work_handler);
+	INIT_DELAYED_WORK(&ec->writer.timeout, ssh_tx_timeout_handler);
+	INIT_KFIFO(ec->writer.ack);
+
+	// initialize request handling
+	ec->pending.queue_tx = rqst_queue_tx;
+	ec->pending.reaper_armed = false;
+	INIT_DELAYED_WORK(&ec->pending.reaper, ssh_reaper_work_handler);
 
 	// initialize receiver
-	init_completion(&ec->receiver.signal);
-	kfifo_init(&ec->receiver.fifo, read_buf, SSH_READ_BUF_LEN);
-	ec->receiver.eval_buf.ptr = eval_buf;
-	ec->receiver.eval_buf.cap = SSH_EVAL_BUF_LEN;
-	ec->receiver.eval_buf.len = 0;
+	ec->receiver.frame.ptr = frame_buf;
+	ec->receiver.frame.cap = SSH_FRAME_BUF_LEN;
+	ec->receiver.frame.len = 0;
+	ec->receiver.frame.state.stage = SSH_RCV_SYNC;
+	ec->receiver.recent.len = 0;
 
 	// initialize event handling
-	ec->events.queue_ack = event_queue_ack;
 	ec->events.queue_evt = event_queue_evt;
+	ec->events.early_total = 0;
+	INIT_DELAYED_WORK(&ec->events.early_expire, ssh_event_early_work_handler);
+	for (i = 0; i < SAM_NUM_EVENT_TYPES; i++) {
+		INIT_LIST_HEAD(&ec->events.subscribers[i]);
+		INIT_LIST_HEAD(&ec->events.early[i]);
+		ec->events.early_len[i] = 0;
+		ssh_event_source_init(&ec->events.source[i],
+				      ssh_event_source_work_handler);
+	}
+	ssh_event_pool_init(&ec->events.pool, event_pool);
+
+	// initialize response cache
+	INIT_LIST_HEAD(&ec->cache.rules);
+	memset(ec->cache.entry, 0, sizeof(ec->cache.entry));
 
 	ec->state = SSH_EC_INITIALIZED;
 
@@ -1478,6 +4314,8 @@ static int surface_sam_ssh_probe(struct serdev_device *serdev)
 		goto err_devinit;
 	}
 
+	ssh_debugfs_init(ec);
+
 	surface_sam_ssh_release(ec);
 
 	acpi_walk_dep_device_list(ssh);
@@ -1489,16 +4327,26 @@ err_devinit:
 err_open:
 	ec->state = SSH_EC_UNINITIALIZED;
 	serdev_device_set_drvdata(serdev, NULL);
+
+	// ensure the transmitter sees the state, then stop it and the reaper
+	smp_mb();
+	flush_workqueue(rqst_queue_tx);
+	cancel_delayed_work_sync(&ec->pending.reaper);
+	cancel_delayed_work_sync(&ec->writer.timeout);
+	cancel_delayed_work_sync(&ec->events.early_expire);
+
+	ssh_event_rt_stop(&ec->events.rt);
+	ssh_event_free_early(ec);
 	surface_sam_ssh_release(ec);
 err_busy:
+	destroy_workqueue(rqst_queue_tx);
+err_rqstq:
 	destroy_workqueue(event_queue_evt);
 err_evtq:
-	destroy_workqueue(event_queue_ack);
-err_ackq:
-	kfree(eval_buf);
-err_eval_buf:
-	kfree(read_buf);
-err_read_buf:
+	kfree(event_pool);
+err_evt_pool:
+	kfree(frame_buf);
+err_frame_buf:
 	kfree(write_buf);
 err_write_buf:
 	return status;
@@ -1509,12 +4357,14 @@ static void surface_sam_ssh_remove(struct serdev_device *serdev)
 	struct sam_ssh_ec *ec;
 	unsigned long flags;
 	int status;
+	int i;
 
 	ec = surface_sam_ssh_acquire_init();
 	if (!ec) {
 		return;
 	}
 
+	ssh_debugfs_exit(ec);
 	surface_sam_ssh_sysfs_unregister(&serdev->dev);
 
 	// suspend EC and disable events
@@ -1523,16 +4373,21 @@ static void surface_sam_ssh_remove(struct serdev_device *serdev)
 		dev_err(&serdev->dev, "failed to suspend EC: %d\n", status);
 	}
 
+	// make sure all requests have been completed
+	ssh_pending_wait_idle(ec);
+
 	// make sure all events (received up to now) have been properly handled
-	flush_workqueue(ec->events.queue_ack);
+	flush_workqueue(ec->pending.queue_tx);
+	ssh_event_rt_flush(&ec->events.rt);
 	flush_workqueue(ec->events.queue_evt);
 
-	// remove event handlers
+	// remove remaining subscribers
 	spin_lock_irqsave(&ec->events.lock, flags);
-	memset(ec->events.handler, 0,
-	       sizeof(struct ssh_event_handler)
-	        * SAM_NUM_EVENT_TYPES);
+	for (i = 0; i < SAM_NUM_EVENT_TYPES; i++) {
+		INIT_LIST_HEAD_RCU(&ec->events.subscribers[i]);
+	}
 	spin_unlock_irqrestore(&ec->events.lock, flags);
+	synchronize_rcu();
 
 	// set device to deinitialized state
 	ec->state  = SSH_EC_UNINITIALIZED;
@@ -1545,34 +4400,47 @@ static void surface_sam_ssh_remove(struct serdev_device *serdev)
 	 * Flush any event that has not been processed yet to ensure we're not going to
 	 * use the serial device any more (e.g. for ACKing).
 	 */
-	flush_workqueue(ec->events.queue_ack);
 	flush_workqueue(ec->events.queue_evt);
 
+	// no requests are pending, stop transmitter and reaper
+	cancel_delayed_work_sync(&ec->pending.reaper);
+	cancel_delayed_work_sync(&ec->writer.timeout);
+	flush_workqueue(ec->pending.queue_tx);
+
 	serdev_device_close(serdev);
 
+	// no new events can be received, stop the immediate-event lane
+	ssh_event_rt_stop(&ec->events.rt);
+	cancel_delayed_work_sync(&ec->events.early_expire);
+
 	/*
          * Only at this point, no new events can be received. Destroying the
          * workqueue here flushes all remaining events. Those events will be
          * silently ignored and neither ACKed nor any handler gets called.
 	 */
-	destroy_workqueue(ec->events.queue_ack);
 	destroy_workqueue(ec->events.queue_evt);
+	destroy_workqueue(ec->pending.queue_tx);
+	ec->pending.queue_tx = NULL;
+
+	// drop buffered events, then all event work has returned to the pool
+	ssh_event_free_early(ec);
+	ssh_event_pool_free(&ec->events.pool);
 
 	// free writer
 	kfree(ec->writer.data);
 	ec->writer.data = NULL;
 	ec->writer.ptr  = NULL;
+	ec->writer.head = NULL;
 
 	// free receiver
-	spin_lock_irqsave(&ec->receiver.lock, flags);
-	ec->receiver.state = SSH_RCV_DISCARD;
-	kfifo_free(&ec->receiver.fifo);
-
-	kfree(ec->receiver.eval_buf.ptr);
-	ec->receiver.eval_buf.ptr = NULL;
-	ec->receiver.eval_buf.cap = 0;
-	ec->receiver.eval_buf.len = 0;
-	spin_unlock_irqrestore(&ec->receiver.lock, flags);
+	spin_lock(&ec->receiver.lock);
+	kfree(ec->receiver.frame.ptr);
+	ec->receiver.frame.ptr = NULL;
+	ec->receiver.frame.cap = 0;
+	ec->receiver.frame.len = 0;
+	ec->receiver.frame.state.stage = SSH_RCV_SYNC;
+	ec->receiver.recent.len = 0;
+	spin_unlock(&ec->receiver.lock);
 
 	serdev_device_set_drvdata(serdev, NULL);
 	surface_sam_ssh_release(ec);
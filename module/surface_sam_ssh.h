@@ -12,6 +12,7 @@
 
 #include <linux/types.h>
 #include <linux/device.h>
+#include <linux/ktime.h>
 
 
 /*
@@ -35,11 +36,33 @@
 
 /*
  * Special event-handler delay value indicating that the corresponding event
- * should be handled immediately in the interrupt and not be relayed through
- * the workqueue. Intended for low-latency events, such as keyboard events.
+ * should be handled immediately by the high-priority event thread and not be
+ * relayed through the workqueue. Intended for low-latency events, such as
+ * keyboard events. Events are dropped if the thread falls too far behind.
  */
 #define SURFACE_SAM_SSH_EVENT_IMMEDIATE		((unsigned long) -1)
 
+/*
+ * Event-subscriber flags.
+ *
+ * SURFACE_SAM_SSH_EVENT_COALESCE: Coalesce delayed events. An event arriving
+ * while an event with the same target category, instance ID, and command ID
+ * is still waiting for its delay to expire replaces the data of the waiting
+ * event instead of being queued on its own. The handler thus runs once per
+ * delay window, with the newest event. Has no effect on events without delay.
+ *
+ * SURFACE_SAM_SSH_EVENT_MATCH_TC, SURFACE_SAM_SSH_EVENT_MATCH_CID: Only
+ * receive events with the target category or command ID of the subscriber.
+ *
+ * SURFACE_SAM_SSH_EVENT_REPLAY: Receive matching events buffered before the
+ * subscriber was registered on subscribing. Only set this for state-change
+ * events that are still meaningful when delivered late, not for input.
+ */
+#define SURFACE_SAM_SSH_EVENT_COALESCE		0x01
+#define SURFACE_SAM_SSH_EVENT_MATCH_TC		0x02
+#define SURFACE_SAM_SSH_EVENT_MATCH_CID		0x04
+#define SURFACE_SAM_SSH_EVENT_REPLAY		0x08
+
 
 struct surface_sam_ssh_buf {
 	u8 cap;
@@ -47,6 +70,41 @@ struct surface_sam_ssh_buf {
 	u8 *data;
 };
 
+/*
+ * Priority class of a request. Queued requests are sent in the order
+ * interactive, normal, background. Requests waiting for too long are sent
+ * regardless of their class, so background requests cannot starve.
+ */
+enum surface_sam_ssh_rqst_prio {
+	SURFACE_SAM_SSH_RQST_PRIO_NORMAL = 0,
+	SURFACE_SAM_SSH_RQST_PRIO_INTERACTIVE,	// directly triggered by the user
+	SURFACE_SAM_SSH_RQST_PRIO_BACKGROUND,	// polling, telemetry
+};
+
+#define SURFACE_SAM_SSH_RQST_PRIO_NUM	3
+
+/*
+ * Request flags.
+ *
+ * SURFACE_SAM_SSH_RQST_IDEMPOTENT: The request has no side effects. If an
+ * identical idempotent request (same target category, instance ID, command
+ * ID, and payload) is already queued or waiting for its response, the request
+ * is not sent on its own but completes with the same status and response.
+ * Callers thus have to accept a response to a request sent before their own.
+ * If the request has a TTL, its response is cached for that long. Cached
+ * responses of a target category are dropped when a request to that target
+ * category without this flag is submitted, or on events matching a cache
+ * rule (see struct surface_sam_ssh_cache_rule).
+ */
+#define SURFACE_SAM_SSH_RQST_IDEMPOTENT		0x01
+
+/*
+ * SURFACE_SAM_SSH_RQST_INTERRUPTIBLE: Wait interruptibly in the synchronous
+ * request functions. If a signal arrives, the requests are cancelled and
+ * -ERESTARTSYS is returned. Has no effect on asynchronous requests.
+ */
+#define SURFACE_SAM_SSH_RQST_INTERRUPTIBLE	0x02
+
 struct surface_sam_ssh_rqst {
 	u8 tc;
 	u8 iid;
@@ -54,8 +112,23 @@ struct surface_sam_ssh_rqst {
 	u8 snc;
 	u8 cdl;
 	u8 *pld;
+	u8 prio;
+	u8 flags;
+	u16 ttl;		// response cache lifetime in ms, idempotent requests only
+	u16 timeout;		// ms until the request fails with -ETIMEDOUT, 0 for none
 };
 
+struct surface_sam_ssh_event_source {
+	u8  tc;
+	u8  unknown;
+	u16 rqid;
+};
+
+/*
+ * The timestamp (CLOCK_MONOTONIC, ktime_get()) is taken when the message
+ * has been received completely, i.e. handler start minus timestamp is the
+ * dispatch latency of the event.
+ */
 struct surface_sam_ssh_event {
 	u16 rqid;
 	u8  tc;
@@ -63,29 +136,126 @@ struct surface_sam_ssh_event {
 	u8  cid;
 	u8  len;
 	u8 *pld;
+	ktime_t timestamp;
 };
 
 
 typedef int (*surface_sam_ssh_event_handler_fn)(struct surface_sam_ssh_event *event, void *data);
 typedef unsigned long (*surface_sam_ssh_event_handler_delay)(struct surface_sam_ssh_event *event, void *data);
 
+/*
+ * What to do with a new event if the backlog of its source is full. The
+ * backlog limit applies to delayed and queued events that have not been
+ * started yet (see the event_backlog module parameter).
+ *
+ * DROP_NEWEST: Drop the new event (default).
+ * DROP_OLDEST: Drop the oldest waiting event of the same subscriber and
+ *              queue the new one. Falls back to DROP_NEWEST if there is none.
+ * COALESCE:    Replace the data of the newest waiting event of the same
+ *              subscriber with the same target category, instance ID, and
+ *              command ID. Falls back to DROP_NEWEST if there is none.
+ */
+enum surface_sam_ssh_event_overflow {
+	SURFACE_SAM_SSH_EVENT_OVERFLOW_DROP_NEWEST = 0,
+	SURFACE_SAM_SSH_EVENT_OVERFLOW_DROP_OLDEST,
+	SURFACE_SAM_SSH_EVENT_OVERFLOW_COALESCE,
+};
+
+/*
+ * Event subscriber, owned by the caller. Any number of subscribers may be
+ * registered for one event RQID, each one receives all events of that RQID
+ * passing its filters. The delay callback is optional. Node, pending count,
+ * and removed flag are private to the SSH driver.
+ */
+struct surface_sam_ssh_event_subscriber {
+	u16 rqid;
+	u8  tc;			// filter, with SURFACE_SAM_SSH_EVENT_MATCH_TC
+	u8  cid;		// filter, with SURFACE_SAM_SSH_EVENT_MATCH_CID
+	u32 flags;
+	u8  overflow;		// enum surface_sam_ssh_event_overflow
+
+	surface_sam_ssh_event_handler_fn handler;
+	surface_sam_ssh_event_handler_delay delay;
+	void *data;
+
+	struct list_head node;
+	atomic_t pending;
+	bool removed;
+};
+
+/*
+ * Response-cache invalidation rule, owned by the caller. Any event with target
+ * category event_tc drops the cached responses of target category rqst_tc.
+ * The node is private to the SSH driver.
+ */
+struct surface_sam_ssh_cache_rule {
+	u8 event_tc;
+	u8 rqst_tc;
+
+	struct list_head node;
+};
+
+/*
+ * Completion callback for asynchronous requests. Called exactly once with the
+ * request status and the result buffer passed on submission. May be called
+ * from atomic context.
+ */
+typedef void (*surface_sam_ssh_rqst_complete_fn)(int status, struct surface_sam_ssh_buf *result, void *data);
+
 int surface_sam_ssh_consumer_register(struct device *consumer);
 
 int surface_sam_ssh_rqst(const struct surface_sam_ssh_rqst *rqst, struct surface_sam_ssh_buf *result);
 
+/*
+ * Submit a request without waiting for it to complete. The request payload is
+ * copied, the result buffer (may be NULL) has to stay valid until the
+ * completion callback has been called. Must be called from process context.
+ */
+int surface_sam_ssh_rqst_async(const struct surface_sam_ssh_rqst *rqst,
+		struct surface_sam_ssh_buf *result,
+		surface_sam_ssh_rqst_complete_fn complete,
+		void *data);
+
+/*
+ * Submit multiple requests at once and wait for all of them to complete.
+ * The requests are sent with as few writes as possible. Returns the status of
+ * the first failed request. The results array may be NULL if none of the
+ * requests expects a response payload.
+ */
+int surface_sam_ssh_rqst_batch(const struct surface_sam_ssh_rqst *rqsts,
+		struct surface_sam_ssh_buf *results, int count);
+
+/*
+ * Cancel all queued and in-flight requests submitted with the given
+ * completion callback and data. Cancelled requests are completed with
+ * -ECANCELED before this function returns, the EC may however still execute
+ * requests that have already been sent. Returns the number of cancelled
+ * requests. Must be called from process context.
+ */
+int surface_sam_ssh_rqst_cancel(surface_sam_ssh_rqst_complete_fn complete, void *data);
+
 int surface_sam_ssh_enable_event_source(u8 tc, u8 unknown, u16 rqid);
 int surface_sam_ssh_disable_event_source(u8 tc, u8 unknown, u16 rqid);
-int surface_sam_ssh_remove_event_handler(u16 rqid);
+int surface_sam_ssh_enable_event_sources(const struct surface_sam_ssh_event_source *src, int count);
+int surface_sam_ssh_disable_event_sources(const struct surface_sam_ssh_event_source *src, int count);
 
-int surface_sam_ssh_set_delayed_event_handler(u16 rqid,
-		surface_sam_ssh_event_handler_fn fn,
-		surface_sam_ssh_event_handler_delay delay,
-		void *data);
+/*
+ * Register an event subscriber. Must stay valid until unsubscribed. Events
+ * received before any subscriber matched them (e.g. during probe) are
+ * buffered in small numbers and replayed to the first matching subscriber
+ * with SURFACE_SAM_SSH_EVENT_REPLAY set.
+ * Unsubscribing may sleep. It drops events of the subscriber that have not
+ * been started yet (e.g. delayed ones) and waits for the running ones, but
+ * not for events of other subscribers.
+ */
+int surface_sam_ssh_event_subscribe(struct surface_sam_ssh_event_subscriber *sub);
+int surface_sam_ssh_event_unsubscribe(struct surface_sam_ssh_event_subscriber *sub);
 
-static inline int surface_sam_ssh_set_event_handler(u16 rqid, surface_sam_ssh_event_handler_fn fn, void *data)
-{
-	return surface_sam_ssh_set_delayed_event_handler(rqid, fn, NULL, data);
-}
+/*
+ * Register a cache invalidation rule. Must stay valid until removed.
+ */
+int surface_sam_ssh_cache_rule_add(struct surface_sam_ssh_cache_rule *rule);
+int surface_sam_ssh_cache_rule_remove(struct surface_sam_ssh_cache_rule *rule);
 
 
 #endif /* _SURFACE_SAM_SSH_H */
@@ -44,6 +44,7 @@ static ssize_t rqst_write(struct file *f, struct kobject *kobj, struct bin_attri
 	rqst.snc = buf[3];
 	rqst.cdl = buf[4];
 	rqst.pld = sam_ssh_debug_rqst_buf_pld;
+	rqst.flags = SURFACE_SAM_SSH_RQST_INTERRUPTIBLE;
 	memcpy(sam_ssh_debug_rqst_buf_pld, buf + 5, count - 5);
 
 	result.cap = SURFACE_SAM_SSH_MAX_RQST_RESPONSE;
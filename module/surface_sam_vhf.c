@@ -32,6 +32,7 @@ struct vhf_evtctx {
 
 struct vhf_drvdata {
 	struct vhf_evtctx event_ctx;
+	struct surface_sam_ssh_event_subscriber event_sub;
 };
 
 
@@ -224,11 +225,12 @@ static int surface_sam_vhf_probe(struct platform_device *pdev)
 
 	platform_set_drvdata(pdev, drvdata);
 
-	status = surface_sam_ssh_set_delayed_event_handler(
-			SAM_EVENT_VHF_RQID,
-	                vhf_event_handler,
-	                vhf_event_delay,
-			&drvdata->event_ctx);
+	drvdata->event_sub.rqid    = SAM_EVENT_VHF_RQID;
+	drvdata->event_sub.handler = vhf_event_handler;
+	drvdata->event_sub.delay   = vhf_event_delay;
+	drvdata->event_sub.data    = &drvdata->event_ctx;
+
+	status = surface_sam_ssh_event_subscribe(&drvdata->event_sub);
 	if (status) {
 		goto err_add_hid;
 	}
@@ -241,7 +243,7 @@ static int surface_sam_vhf_probe(struct platform_device *pdev)
 	return 0;
 
 err_event_source:
-	surface_sam_ssh_remove_event_handler(SAM_EVENT_VHF_RQID);
+	surface_sam_ssh_event_unsubscribe(&drvdata->event_sub);
 err_add_hid:
 	hid_destroy_device(hid);
 	platform_set_drvdata(pdev, NULL);
@@ -255,7 +257,7 @@ static int surface_sam_vhf_remove(struct platform_device *pdev)
 	struct vhf_drvdata *drvdata = platform_get_drvdata(pdev);
 
 	surface_sam_ssh_disable_event_source(SAM_EVENT_VHF_TC, 0x01, SAM_EVENT_VHF_RQID);
-	surface_sam_ssh_remove_event_handler(SAM_EVENT_VHF_RQID);
+	surface_sam_ssh_event_unsubscribe(&drvdata->event_sub);
 
 	hid_destroy_device(drvdata->event_ctx.hid);
 	kfree(drvdata);